@@ -17,6 +17,8 @@
 #include "adapter.h"
 #include "hidapi.h"
 #include "pic32.h"
+#include "crc.h"
+#include "stats.h"
 
 #define FRAME_SOH           0x01
 #define FRAME_EOT           0x04
@@ -28,6 +30,13 @@
 #define CMD_READ_CRC        0x04
 #define CMD_JUMP_APP        0x05
 
+/*
+ * Limit of the escaped frame length.
+ * The bootloader collects a frame in a 1000-byte buffer,
+ * so a few Intel HEX records can be sent in one command.
+ */
+#define FRAME_MAXLEN        960
+
 typedef struct {
     /* Common part */
     adapter_t adapter;
@@ -47,28 +56,17 @@ typedef struct {
 #define BOOTLOADER_PID          0x003c  /* Microchip AN1388 Bootloader */
 
 /*
- * Calculate checksum.
+ * Send a frame, split into 64-byte HID reports.
+ * The reports are sent back to back: the reply comes
+ * only after the whole frame is received.
+ * The buffer must be padded up to a multiple of 64 bytes.
+ * Every report is prefixed with report ID 0: otherwise a report
+ * starting with 0x00 in the middle of a frame would lose this byte.
  */
-static unsigned calculate_crc(unsigned crc, unsigned char *data, unsigned nbytes)
-{
-    static const unsigned short crc_table [16] = {
-        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
-        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
-    };
-    unsigned i;
-
-    while (nbytes--) {
-        i = (crc >> 12) ^ (*data >> 4);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        i = (crc >> 12) ^ (*data >> 0);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        data++;
-    }
-    return crc & 0xffff;
-}
-
 static void an1388_send(hid_device *hiddev, unsigned char *buf, unsigned nbytes)
 {
+    unsigned char report [1 + 64];
+
     if (debug_level > 0) {
         int k;
         fprintf(stderr, "---Send");
@@ -79,14 +77,24 @@ static void an1388_send(hid_device *hiddev, unsigned char *buf, unsigned nbytes)
         }
         fprintf(stderr, "\n");
     }
-    hid_write(hiddev, buf, 64);
+    for (; nbytes > 0; nbytes -= (nbytes > 64) ? 64 : nbytes) {
+        unsigned long long t0 = stats_time();
+
+        report[0] = 0;
+        memcpy(report + 1, buf, 64);
+        hid_write(hiddev, report, sizeof(report));
+        stats_event(STAT_USB_OUT, 64, t0);
+        buf += 64;
+    }
 }
 
 static int an1388_recv(hid_device *hiddev, unsigned char *buf)
 {
+    unsigned long long t0 = stats_time();
     int n;
 
     n = hid_read(hiddev, buf, 64);
+    stats_event(STAT_USB_IN, n > 0 ? n : 0, t0);
     if (n <= 0) {
         fprintf(stderr, "hidboot: error %d receiving packet\n", n);
         exit(-1);
@@ -120,7 +128,7 @@ static inline unsigned add_byte(unsigned char c,
 static void an1388_command(an1388_adapter_t *a, unsigned char cmd,
     unsigned char *data, unsigned data_len)
 {
-    unsigned char buf [64];
+    unsigned char buf [FRAME_MAXLEN + 64];
     unsigned i, n, c, crc;
 
     if (debug_level > 0) {
@@ -261,87 +269,98 @@ static void an1388_verify_data(adapter_t *adapter,
     }
 }
 
-static void set_flash_address(an1388_adapter_t *a, unsigned addr)
+/*
+ * Build an Intel HEX record: return the length.
+ */
+static unsigned make_record(unsigned char *rec, unsigned type,
+    unsigned addr, unsigned char *data, unsigned nbytes)
 {
-    unsigned char request[7];
     unsigned sum, i;
 
-    request[0] = 2;
-    request[1] = 0;
-    request[2] = 0;
-    request[3] = 4;             /* Type: linear address record */
-    request[4] = addr >> 24;
-    request[5] = addr >> 16;
+    rec[0] = nbytes;
+    rec[1] = addr >> 8;
+    rec[2] = addr;
+    rec[3] = type;
+    memcpy(rec+4, data, nbytes);
 
     /* Compute checksum. */
     sum = 0;
-    for (i=0; i<6; i++)
-        sum += request[i];
-    request[6] = -sum;
-
-    an1388_command(a, CMD_PROGRAM_FLASH, request, 7);
-    if (a->reply_len != 1 || a->reply[0] != CMD_PROGRAM_FLASH) {
-        fprintf(stderr, "hidboot: error setting flash address at %08x\n", addr);
-        exit(-1);
-    }
+    for (i=0; i<nbytes+4; i++)
+        sum += rec[i];
+    rec[nbytes+4] = -sum;
+    return nbytes + 5;
 }
 
-static void program_flash(an1388_adapter_t *a,
-    unsigned addr, unsigned char *data, unsigned nbytes)
+/*
+ * Number of bytes, which need an escape in a frame.
+ */
+static unsigned count_escapes(unsigned char *data, unsigned nbytes)
 {
-    unsigned char request[64];
-    unsigned sum, empty, i;
-
-    /* Skip empty blocks. */
-    empty = 1;
-    for (i=0; i<nbytes; i++) {
-        if (data[i] != 0xff) {
-            empty = 0;
-            break;
-        }
-    }
-    if (empty)
-        return;
-    //fprintf(stderr, "hidboot: program %d bytes at %08x: %02x-%02x-...-%02x\n",
-    //    nbytes, addr, data[0], data[1], data[31]);
+    unsigned n = 0;
 
-    request[0] = nbytes;
-    request[1] = addr >> 8;
-    request[2] = addr;
-    request[3] = 0;             /* Type: data record */
-    memcpy(request+4, data, nbytes);
-
-    /* Compute checksum. */
-    sum = 0;
-    empty = 1;
-    for (i=0; i<nbytes+4; i++) {
-        sum += request[i];
+    while (nbytes-- > 0) {
+        unsigned char c = *data++;
+        if (c == FRAME_EOT || c == FRAME_SOH || c == FRAME_DLE)
+            n++;
     }
-    request[nbytes+4] = -sum;
+    return n;
+}
 
-    an1388_command(a, CMD_PROGRAM_FLASH, request, nbytes + 5);
+/*
+ * Send a sequence of HEX records in one command.
+ */
+static void program_records(an1388_adapter_t *a, unsigned addr,
+    unsigned char *request, unsigned nbytes)
+{
+    an1388_command(a, CMD_PROGRAM_FLASH, request, nbytes);
     if (a->reply_len != 1 || a->reply[0] != CMD_PROGRAM_FLASH) {
-        fprintf(stderr, "hidboot: error programming flash at %08x\n", addr);
+        fprintf(stderr, "%s: error programming flash at %08x\n", "hidboot", addr);
         exit(-1);
     }
 }
 
 /*
  * Flash write, 1-kbyte blocks.
+ * Non-blank 32-byte records are packed into as few
+ * commands as the frame length permits.
  */
 static void an1388_program_block(adapter_t *adapter,
     unsigned addr, unsigned *data)
 {
     an1388_adapter_t *a = (an1388_adapter_t*) adapter;
-    unsigned i;
-
-    set_flash_address(a, addr);
-    for (i=0; i<256; i+=8) {
-        /* 8 words per cycle. */
-        program_flash(a, addr, (unsigned char*) data, 32);
-        data += 8;
-        addr += 32;
+    unsigned char request [FRAME_MAXLEN], hiaddr[2], *p;
+    unsigned i, len, nesc, reclen, nrec, frame_addr;
+
+    /* Start with a linear address record. */
+    hiaddr[0] = addr >> 24;
+    hiaddr[1] = addr >> 16;
+    len = make_record(request, 4, 0, hiaddr, 2);
+    nesc = count_escapes(request, len);
+    nrec = 0;
+    frame_addr = addr;
+
+    for (i=0; i<1024; i+=32) {
+        /* Skip empty records. */
+        p = i + (unsigned char*) data;
+        if (adapter_is_blank(p, 32))
+            continue;
+
+        /* Frame: SOH, command, records and CRC, all escaped, EOT. */
+        reclen = 32 + 5;
+        if (2 + 2*(1 + 2) + len + nesc + 2*reclen > FRAME_MAXLEN) {
+            program_records(a, frame_addr, request, len);
+            len = 0;
+            nesc = 0;
+            nrec = 0;
+            frame_addr = addr + i;
+        }
+        reclen = make_record(request + len, 0, addr + i, p, 32);
+        nesc += count_escapes(request + len, reclen);
+        len += reclen;
+        nrec++;
     }
+    if (nrec > 0)
+        program_records(a, frame_addr, request, len);
 }
 
 /*
@@ -18,13 +18,18 @@
 #include "adapter.h"
 #include "pic32.h"
 #include "serial.h"
+#include "crc.h"
+#include "stats.h"
 
 typedef struct {
     adapter_t adapter;              /* Common part */
 
     int BitsToRead;                 // number of 'bits' waiting in Rx buffer
     int CharToRead;                 // number of characters the bits are encoded into
-    int PendingHandshake;           // indicates a return handshake is expected
+    int PendingSyncs;               // number of '>' sent, '<' not yet received
+    int QueuedChars;                // number of characters queued by speculative reads
+    int BinaryFastData;             // programmer accepts '#' FASTDATA words (v1F)
+    int RepeatFastData;             // programmer accepts '*' repeated words (v1G)
 
     unsigned TotalCodeChrsSent;     // count of total # of code characters sent out
     unsigned TotalCodeChrsRecv;     // count of total # of code characters received
@@ -35,6 +40,7 @@ typedef struct {
     unsigned WriteCount;            // number of calls to serial_write
     unsigned Read1Count;            // number of calls to serial_read (data)
     unsigned Read2Count;            // number of calls to serial_read (handshakes)
+    unsigned SyncCount;             // number of '>' sync requests sent
     unsigned FDataCount;            // number of calls to xfer_fastdata
     unsigned DelayCount[4];         // number of calls to delay10mS (erase, xfer inst, PE resp, other)
     struct timeval T1, T2;          // record start and finishing timestamps
@@ -53,27 +59,10 @@ static int CFG3 = 1;    // 0 = uncompressed stream (use only 'd','e','f','g'
                         // 1 = use 4-bit packing (on data only) 'i'-'x','I'-'X','a','z','A'
 static int CFG4 = 1;    // decompression method in serial read (normally set to match CFG3)
 static int MAXW = 440;  // maximum continuous write before sync: 900 + 50 < 1024, 440 + 30 < 512
-
-/*
- * Calculate checksum.
- */
-static unsigned calculate_crc(unsigned crc, unsigned char *data, unsigned nbytes)
-{
-    static const unsigned short crc_table [16] = {
-        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
-        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
-    };
-    unsigned i;
-
-    while (nbytes--) {
-        i = (crc >> 12) ^ (*data >> 4);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        i = (crc >> 12) ^ (*data >> 0);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        data++;
-    }
-    return crc & 0xffff;
-}
+                        // (with CFG1 = 2, a '>' is sent every MAXW/2 characters, and the
+                        // reply is only waited for when two syncs are outstanding)
+static int CFG5 = 1;    // 1 = speculative serial execution: send up to 8 instructions without
+                        // waiting for PrAcc, then check all PrAcc values at once
 
 /*
  * Sends a command ('8')to the programmer telling it to insert
@@ -91,6 +80,81 @@ static void bitbang_delay10mS(bitbang_adapter_t *a, int caller)
     a->DelayCount[caller]++;
 }
 
+/*
+ * Wait for '<' replies, until no more than keep syncs are outstanding.
+ */
+static void bitbang_sync_wait(bitbang_adapter_t *a, int keep)
+{
+    unsigned char ch;
+    int n;
+
+    while (a->PendingSyncs > keep) {
+        n = serial_read(&ch, 1, 250);
+        a->Read2Count++;
+        a->PendingSyncs--;
+
+        if (n != 1 || ch != '<')
+            fprintf(stderr, "WARNING - handshake read error (in send)\n");
+    }
+}
+
+/*
+ * Write encoded commands to the programmer, with flow control.
+ * The buffer must have space for one more character.
+ *
+ * The programmer has a limited Rx buffer, so a '>' sync request is
+ * inserted periodically. Instead of stopping on every '>' until the
+ * '<' comes back, a window of two syncs is kept: the host waits for
+ * the older one only, while the programmer still has the characters
+ * after it to execute. Thus the link never runs dry.
+ */
+static void bitbang_write(bitbang_adapter_t *a,
+    unsigned char *buffer, int index, int read_flag)
+{
+    int sync = 0;
+
+    //
+    // a read needs all previous syncs off the Rx stream; otherwise
+    // wait until the window has space for a new sync
+    //
+    if (read_flag && !a->QueuedChars)
+        bitbang_sync_wait(a, 0);
+    else
+        bitbang_sync_wait(a, (CFG1 == 1 ? 0 : 1));
+
+    //
+    // the below block is to implement handshake on
+    // EVERY write that does not have (read_flag != 0)
+    //
+    if (CFG1 == 1 && !read_flag && !a->QueuedChars)
+        sync = 1;
+
+    //
+    // this block is to implement handshake on every 450/220 (MAXW/2) characters;
+    // two segments in flight: 900 + 50 < 1024, 440 + 60 < 512
+    //
+    if (CFG1 == 2 && !read_flag && !a->QueuedChars &&
+        (a->RunningWriteCount + index) > MAXW/2)
+        sync = 1;
+
+    if (sync)
+        buffer[index++] = '>';
+    a->RunningWriteCount += index;               // number of characters being written
+    if (sync) {
+        //////// this code is also duplicated in bitbang_recv ////////
+        if (a->RunningWriteCount > a->MaxBufferedWrites)
+            a->MaxBufferedWrites = a->RunningWriteCount;
+        a->RunningWriteCount = 0;
+        //////////////////////////////////////////////////////////////
+
+        a->PendingSyncs++;
+        a->SyncCount++;
+    }
+
+    serial_write(buffer, index);
+    a->WriteCount++;
+}
+
 /*
  * Current version of bitbang_send, sends a string of data out to the target encoded
  * as ASCII characters to be interpreted by an intellenent ICSP programmer.
@@ -120,6 +184,10 @@ static void bitbang_delay10mS(bitbang_adapter_t *a, int caller)
  * 'A' : data header with read_flag = 1 on last bit
  * 'I'..'X' : 4 TDI bits encoded, TMS = 0, read_flag = 1
  *
+ * '#' : FASTDATA word, 4 binary bytes follow (v1F)
+ * '=' : return accumulated PrAcc as '0'/'1', reset it (v1F)
+ * '*' : FASTDATA word repeated, count byte and 4 binary bytes follow (v1G)
+ *
  * '.' : no operation, used for formatting
  * '>' : request sync response - '<'
  *
@@ -159,7 +227,7 @@ static void bitbang_send(bitbang_adapter_t *a,
     int index = 0;              // index of next slot to use in buffer
     int pairs = 0;              // count of number of TDI/TMS pairs
     int count = 0;              // count of the number of symbols used
-    int i, n;
+    int i;
     unsigned char ch;
 
     if (a->BitsToRead != 0)
@@ -242,69 +310,50 @@ static void bitbang_send(bitbang_adapter_t *a,
         pairs += 2;
     }
 
-    //
-    // Control handshaking for ICSP programmers
-    //
-
-    if (a->PendingHandshake)
-    {
-        //////// this code is also duplicated in bitbang_send ////////
-        if (a->RunningWriteCount > a->MaxBufferedWrites)
-            a->MaxBufferedWrites = a->RunningWriteCount;
-        a->RunningWriteCount = 0;
-        //////////////////////////////////////////////////////////////
-
-        a->PendingHandshake = 0;
-
-        n = serial_read(&ch, 1, 250);
-        a->Read2Count++;
-
-        if (n != 1 || ch != '<')
-            fprintf(stderr, "WARNING - handshake read error (in send)\n");
-    }
-
-    //
-    // the below block is to implement handshake on
-    // EVERY write that does not have (read_flag != 0)
-    //
-    if (CFG1 == 1 && !read_flag)
-    {
-        buffer[index++] = '>';
-        a->PendingHandshake = 1;
-    }
-
-    //
-    // this block is to implement handshake on every 900/440 (MAXW) characters
-    // NOTE: assumes the Rx buffer in the programmer is 1024/512 bytes long
-    //                                                  **************
-
-    if (CFG1 == 2 && !read_flag && (a->RunningWriteCount + index) > MAXW)   // 900 + 50 < 1024
-    {                                                                       // 440 + 30 < 512
-        buffer[index++] = '>';
-        a->PendingHandshake = 1;
-    }
-
-    //
-    // end of handshaking code
-    //
-
-    buffer[index] = 0;          // append trailing zero so can print as a string
-
-    a->RunningWriteCount += index;               // number of characters being written
-    a->TotalBitPairsSent += pairs;               // number of TDI/TMS pairs encoded
-    a->TotalCodeChrsSent += count;               // number of symbols used to send pairs
-
     if (DBG1) {
         unsigned L4 = Xtdi >> 48;
         unsigned L3 = (Xtdi >> 32) & 0xFFFF;
         unsigned L2 = (Xtdi >> 16) & 0xFFFF;
         unsigned L1 = Xtdi & 0xFFFF;
+        buffer[index] = 0;      // append trailing zero so can print as a string
         printf("n=%i, <%s> read=%i TDI: %04x %04x %04x %04x\n",
                 index, buffer, read_flag, L4,  L3,  L2,  L1);
     }
 
-    serial_write(buffer, index);
-    a->WriteCount++;
+    a->TotalBitPairsSent += pairs;               // number of TDI/TMS pairs encoded
+    a->TotalCodeChrsSent += count;               // number of symbols used to send pairs
+    bitbang_write(a, buffer, index, read_flag);
+}
+
+/*
+ * Decode TDO bits returned by the programmer, last character first.
+ * (by RR)
+ */
+static unsigned long long bitbang_decode(unsigned char *buffer, int n)
+{
+    unsigned long long word = 0;
+    int i;
+
+    for (i = n-1; i >=0; i--) {
+
+        if ((buffer[i] >= 'I') && (buffer[i] <= 'X'))
+            word = (word << 4) | (buffer[i] - 'I');
+        else {
+            switch (buffer[i]) {
+                case ('0'):
+                    word = (word << 1) | 0;
+                    break;
+                case ('1'):
+                    word = (word << 1) | 1;
+                    break;
+                default:
+                    fprintf(stderr,
+                        "WARNING - unexpected character (0x%02x) returned (in recv)\n",
+                                                       buffer[i]);
+            }  // switch
+        }  // if ... else
+    }  // for loop
+    return word;
 }
 
 /*
@@ -314,15 +363,15 @@ static unsigned long long bitbang_recv(bitbang_adapter_t *a)
 {
     unsigned char buffer[70];
     unsigned long long word;
-    int n, i;
+    int n;
 
-    //////// this code is also duplicated in bitbang_send ////////
+    //////// this code is also duplicated in bitbang_write ////////
     if (a->RunningWriteCount > a->MaxBufferedWrites)
         a->MaxBufferedWrites = a->RunningWriteCount;
     a->RunningWriteCount = 0;
     //////////////////////////////////////////////////////////////
 
-    if (a->PendingHandshake)
+    if (a->PendingSyncs)
         fprintf(stderr, "WARNING - handshake pending error (in recv)\n");
 
     int expected = (CFG4 ? a->CharToRead : a->BitsToRead);
@@ -337,27 +386,7 @@ static unsigned long long bitbang_recv(bitbang_adapter_t *a)
             "WARNING - fewer characters read (%i) than expected (%i) (in recv)\n",
                                               n,              expected);
 
-    word = 0;
-
-    for (i = n-1; i >=0; i--) {
-
-        if ((buffer[i] >= 'I') && (buffer[i] <= 'X'))
-            word = (word << 4) | (buffer[i] - 'I');
-        else {
-            switch (buffer[i]) {
-                case ('0'):
-                    word = (word << 1) | 0;
-                    break;
-                case ('1'):
-                    word = (word << 1) | 1;
-                    break;
-                default:
-                    fprintf(stderr,
-                        "WARNING - unexpected character (0x%02x) returned (in recv)\n",
-                                                       buffer[i]);
-            }  // switch
-        }  // if ... else
-    }  // for loop
+    word = bitbang_decode(buffer, n);
 
     if (DBG1) {
         unsigned L4 = word >> 48;
@@ -389,6 +418,7 @@ static void bitbang_ICSP_enable(bitbang_adapter_t *a, int ICSP_EN)
                                  // 1234567890123456789012345678901234567890123456789012345678901234
 
         serial_write(buffer, 64);
+        serial_flush();
         usleep(150000);    // 150mS delay to allow the above to percolate through the system
     }
     else
@@ -399,6 +429,7 @@ static void bitbang_ICSP_enable(bitbang_adapter_t *a, int ICSP_EN)
                                  // 1234567890123456
 
         serial_write(buffer, 16);
+        serial_flush();
 
         // 100mS delay to allow the above to percolate through the system
         usleep(100000);
@@ -435,6 +466,7 @@ static void bitbang_close(adapter_t *adapter, int power_on)
     printf("O/S serial writes        = %i\n", a->WriteCount);
     printf("O/S serial reads (data)  = %i\n", a->Read1Count);
     printf("O/S serial reads (sync)  = %i\n", a->Read2Count);
+    printf("sync requests sent       = %i\n", a->SyncCount);
     printf("XferFastData count       = %i\n", a->FDataCount);
     printf("10mS delays (E/X/R)      = %i/%i/%i\n", a->DelayCount[0],
                                                     a->DelayCount[1],
@@ -442,6 +474,17 @@ static void bitbang_close(adapter_t *adapter, int power_on)
     printf("elapsed programming time = %lum %02lus\n", (a->T2.tv_sec - a->T1.tv_sec) / 60,
                                                        (a->T2.tv_sec - a->T1.tv_sec) % 60);
 
+    long msec = (a->T2.tv_sec - a->T1.tv_sec) * 1000 +
+                (a->T2.tv_usec - a->T1.tv_usec) / 1000;
+    if (msec > 0) {
+        printf("throughput (sent)        = %li chars/sec, %li pairs/sec\n",
+                                    a->TotalCodeChrsSent * 1000L / msec,
+                                    a->TotalBitPairsSent * 1000L / msec);
+        printf("protocol                 = %s\n",
+            a->RepeatFastData ? "v1G, binary FASTDATA with repeat" :
+            a->BinaryFastData ? "v1F, binary FASTDATA" : "v1E, ascii");
+    }
+
     serial_close();                    // at this point we are exiting application???
 //  free(a);                           // suspect this line was causing XP CRASHES
                                        // - shouldn't be needed anyway
@@ -527,6 +570,22 @@ static void xfer_fastdata(bitbang_adapter_t *a, unsigned word)
 {
     a->FDataCount++;
 
+    if (a->BinaryFastData) {
+        // v1F programmer: whole word in 5 characters, PrAcc is
+        // accumulated by the programmer and checked in get_pe_response
+        unsigned char buffer[6];
+
+        buffer[0] = '#';
+        buffer[1] = word;
+        buffer[2] = word >> 8;
+        buffer[3] = word >> 16;
+        buffer[4] = word >> 24;
+        a->TotalBitPairsSent += 38;
+        a->TotalCodeChrsSent += 5;
+        bitbang_write(a, buffer, 5, 0);
+        return;
+    }
+
     if (CFG2 == 1)
         bitbang_send(a, 0, 0, 33, (unsigned long long) word << 1, 0);
 
@@ -550,6 +609,76 @@ static void xfer_fastdata(bitbang_adapter_t *a, unsigned word)
     // programming adaptor.
 }
 
+/*
+ * Send a word by FASTDATA, and wait until the PE takes it.
+ * While a row is being written, the PE does not read FASTDATA:
+ * the word is rejected with PrAcc bit cleared, and is sent again.
+ */
+static void xfer_fastdata_sync(bitbang_adapter_t *a, unsigned word)
+{
+    unsigned status;
+    int i = 0;
+
+    a->FDataCount++;
+    do {
+        if (i > 100)
+            bitbang_delay10mS(a, 1);
+        bitbang_send(a, 0, 0, 33, (unsigned long long) word << 1, 2);
+        status = bitbang_recv(a);
+        stats_event(STAT_PRACC_POLL, 0, 0);
+        i++;
+    } while (! (status & 1) && i < 150);
+
+    if (! (status & 1)) {
+        fprintf(stderr, "PE does not accept data, PrAcc not set (in XferFastDataSync)\n");
+        exit(-1);
+    }
+}
+
+/*
+ * Send an array of words by FASTDATA.
+ * With a v1G programmer, a run of equal words is sent
+ * as a single '*' command: count and the word.
+ */
+static void xfer_fastdata_array(bitbang_adapter_t *a,
+    const unsigned *data, unsigned nwords)
+{
+    unsigned char buffer[7];
+    unsigned n, maxrun;
+
+    // a run counts as 5 characters per word: limit it to MAXW/2,
+    // so that it never overflows the sync window
+    maxrun = MAXW / 10;
+    if (maxrun > 255)
+        maxrun = 255;
+
+    while (nwords > 0) {
+        for (n = 1; n < nwords && n < maxrun && data[n] == data[0]; n++)
+            continue;
+        if (! a->RepeatFastData || n < 2) {
+            xfer_fastdata(a, *data++);
+            nwords--;
+            continue;
+        }
+        buffer[0] = '*';
+        buffer[1] = n;
+        buffer[2] = data[0];
+        buffer[3] = data[0] >> 8;
+        buffer[4] = data[0] >> 16;
+        buffer[5] = data[0] >> 24;
+        a->FDataCount += n;
+        a->TotalBitPairsSent += 38 * n;
+        a->TotalCodeChrsSent += 6;
+        bitbang_write(a, buffer, 6, 0);
+
+        // the programmer needs as much time for the run as for n '#'
+        // commands: count them so, to keep the sync window in time
+        a->RunningWriteCount += 5 * n - 6;
+        data += n;
+        nwords -= n;
+    }
+}
+
 static void xfer_instruction(bitbang_adapter_t *a, unsigned instruction)
 {
     unsigned ctl;
@@ -577,6 +706,7 @@ static void xfer_instruction(bitbang_adapter_t *a, unsigned instruction)
         // CONTROL_PRACC | CONTROL_PROBEN | CONTROL_PROBTRAP
 
         ctl = bitbang_recv(a);
+        stats_event(STAT_PRACC_POLL, 0, 0);
         i++;
     } while (! (ctl & CONTROL_PRACC) && i < 150);
 
@@ -596,9 +726,155 @@ static void xfer_instruction(bitbang_adapter_t *a, unsigned instruction)
                               CONTROL_PROBTRAP, 0);
 }
 
-static unsigned get_pe_response(bitbang_adapter_t *a)
+/*
+ * Speculative version of xfer_instruction: send a batch of instructions
+ * without waiting for PrAcc. The Control register is still read for
+ * every instruction, but all the replies are collected at the end of
+ * a batch in one serial read. A batch of 8 instructions (about 430
+ * characters) fits into MAXW, so no '>' sync is needed in between.
+ * Returns 0 if the CPU was not ready for some instruction.
+ */
+#define SPEC_BATCH 8
+
+/*
+ * Check whether the instruction is a store to memory.
+ * When the CPU was not ready, the next instructions of a batch may
+ * run with registers not loaded yet. So every store starts a new
+ * batch: it runs only after all previous instructions are confirmed.
+ */
+static int is_store(unsigned instruction)
+{
+    unsigned opcode = instruction >> 26;
+
+    return (opcode & 0x38) == 0x28 || (opcode & 0x38) == 0x38;
+}
+
+static int xfer_instructions_fast(bitbang_adapter_t *a,
+    const unsigned *code, unsigned ninstr)
+{
+    unsigned char buffer[SPEC_BATCH * 33 + 1];
+    int nchars[SPEC_BATCH];
+    unsigned i, k, n;
+    int total, got, offset;
+    unsigned long long ctl;
+
+    for (i = 0; i < ninstr; i += n) {
+        for (n = 1; i + n < ninstr && n < SPEC_BATCH; n++)
+            if (is_store(code[i+n]))
+                break;
+
+        for (k = 0; k < n; k++) {
+            if (debug_level > 1)
+                fprintf(stderr, "xfer instruction %08x\n", code[i+k]);
+
+            // Select Control Register, read PrAcc later
+            bitbang_send(a, 1, 1, 5, ETAP_CONTROL, 0);    /* Send command. */
+            bitbang_send(a, 0, 0, 32, CONTROL_PRACC |     /* Xfer data. */
+                                     CONTROL_PROBEN |
+                                   CONTROL_PROBTRAP, 1);
+            nchars[k] = (CFG4 ? a->CharToRead : a->BitsToRead);
+            a->QueuedChars += nchars[k];
+            a->TotalBitsReceived += a->BitsToRead;
+            a->BitsToRead = 0;
+
+            // Select Data Register
+            // Send the instruction
+            bitbang_send(a, 1, 1, 5, ETAP_DATA, 0);       /* Send command. */
+            bitbang_send(a, 0, 0, 32, code[i+k], 0);      /* Send data. */
+
+            // Tell CPU to execute instruction
+            bitbang_send(a, 1, 1, 5, ETAP_CONTROL, 0);    /* Send command. */
+            bitbang_send(a, 0, 0, 32, CONTROL_PROBEN |    /* Send data. */
+                                      CONTROL_PROBTRAP, 0);
+        }
+
+        //////// this code is also duplicated in bitbang_write ////////
+        if (a->RunningWriteCount > a->MaxBufferedWrites)
+            a->MaxBufferedWrites = a->RunningWriteCount;
+        a->RunningWriteCount = 0;
+        //////////////////////////////////////////////////////////////
+
+        total = a->QueuedChars;
+        a->QueuedChars = 0;
+        got = serial_read(buffer, total, 250);
+        a->TotalCodeChrsRecv += got;
+        a->Read1Count++;
+
+        if (got != total) {
+            fprintf(stderr,
+                "WARNING - fewer characters read (%i) than expected (%i) (in XferInstructions)\n",
+                                                  got,              total);
+            return 0;
+        }
+
+        /* Check PrAcc for every instruction. */
+        offset = 0;
+        for (k = 0; k < n; k++) {
+            ctl = bitbang_decode(buffer + offset, nchars[k]);
+            offset += nchars[k];
+            if (! (ctl & CONTROL_PRACC)) {
+                if (debug_level > 0)
+                    fprintf(stderr, "CPU not ready for instruction %08x\n", code[i+k]);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Execute a sequence of instructions. The sequence must be restartable:
+ * if the CPU was not ready for some instruction, the whole sequence
+ * is repeated with PrAcc polled before every instruction.
+ */
+static void xfer_instructions(bitbang_adapter_t *a,
+    const unsigned *code, unsigned ninstr)
+{
+    unsigned i;
+
+    if (CFG5 && CFG3) {                         // batch fits into MAXW only when packed
+        if (xfer_instructions_fast(a, code, ninstr))
+            return;
+
+        /* Don't speculate anymore. */
+        CFG5 = 0;
+        fprintf(stderr, "\nWARNING - CPU not ready, switching to slow serial execution\n");
+    }
+    for (i = 0; i < ninstr; i++)
+        xfer_instruction(a, code[i]);
+}
+
+/*
+ * Retrieve PrAcc accumulated by the v1F programmer during
+ * FASTDATA transfers, and alert if it was ever 0.
+ */
+static void check_pracc(bitbang_adapter_t *a)
 {
-    unsigned ctl, response;
+    unsigned char ch[2] = { '=' };
+    int n;
+
+    bitbang_write(a, ch, 1, 1);
+    n = serial_read(ch, 1, 250);
+    a->TotalCodeChrsRecv += n;
+    a->Read1Count++;
+
+    if (n != 1 || ch[0] != '1') {
+        printf("!");
+        fflush(stdout);
+    }
+}
+
+/*
+ * Wait for a PE response, polling PrAcc at most maxpolls times.
+ * Return 0 on timeout.
+ */
+static int try_pe_response(bitbang_adapter_t *a, int maxpolls,
+    unsigned *response)
+{
+    unsigned ctl;
+
+    if (a->BinaryFastData)
+        check_pracc(a);
 
     // Select Control Register
     bitbang_send(a, 1, 1, 5, ETAP_CONTROL, 0);        /* Send command. */
@@ -620,26 +896,36 @@ static unsigned get_pe_response(bitbang_adapter_t *a)
         // CONTROL_PRACC | CONTROL_PROBEN | CONTROL_PROBTRAP
 
         ctl = bitbang_recv(a);
+        stats_event(STAT_PRACC_POLL, 0, 0);
         i++;
-    } while (! (ctl & CONTROL_PRACC) && i < 150);
+    } while (! (ctl & CONTROL_PRACC) && i < maxpolls);
 
-    if (i == 150) {
-        fprintf(stderr, "PE response, PrAcc not set (in GetPEResponse)\n");
-        exit(-1);
-    }
+    if (! (ctl & CONTROL_PRACC))
+        return 0;
 
     // Select Data Register
     // Send the instruction
     bitbang_send(a, 1, 1, 5, ETAP_DATA, 0);           /* Send command. */
     bitbang_send(a, 0, 0, 32, 0, 1);                  /* Get data. */
-    response = bitbang_recv(a);
+    *response = bitbang_recv(a);
 
     // Tell CPU to execute NOP instruction
     bitbang_send(a, 1, 1, 5, ETAP_CONTROL, 0);        /* Send command. */
     bitbang_send(a, 0, 0, 32, CONTROL_PROBEN |        /* Send data. */
                               CONTROL_PROBTRAP, 0);
     if (debug_level > 1)
-        fprintf(stderr, "get PE response %08x\n", response);
+        fprintf(stderr, "get PE response %08x\n", *response);
+    return 1;
+}
+
+static unsigned get_pe_response(bitbang_adapter_t *a)
+{
+    unsigned response;
+
+    if (! try_pe_response(a, 150, &response)) {
+        fprintf(stderr, "PE response, PrAcc not set (in GetPEResponse)\n");
+        exit(-1);
+    }
     return response;
 }
 
@@ -657,13 +943,17 @@ static unsigned bitbang_read_word(adapter_t *adapter, unsigned addr)
     if (DBG2)
         fprintf(stderr, "read_word\n");
 
+    unsigned code[5] = {
+        0x3c04bf80,                             // lui s3, 0xFF20
+        0x3c080000 | addr_hi,                   // lui t0, addr_hi
+        0x35080000 | addr_lo,                   // ori t0, addr_lo
+        0x8d090000,                             // lw t1, 0(t0)
+        0xae690000,                             // sw t1, 0(s3)
+    };
+
     serial_execution(a);
 
-    xfer_instruction(a, 0x3c04bf80);            // lui s3, 0xFF20
-    xfer_instruction(a, 0x3c080000 | addr_hi);  // lui t0, addr_hi
-    xfer_instruction(a, 0x35080000 | addr_lo);  // ori t0, addr_lo
-    xfer_instruction(a, 0x8d090000);            // lw t1, 0(t0)
-    xfer_instruction(a, 0xae690000);            // sw t1, 0(s3)
+    xfer_instructions(a, code, 5);
 
     bitbang_send(a, 1, 1, 5, ETAP_FASTDATA, 0); /* Send command. */
     bitbang_send(a, 0, 0, 33, 0, 1);            /* Get fastdata. */
@@ -715,6 +1005,22 @@ static void bitbang_read_data(adapter_t *adapter,
     }
 }
 
+/*
+ * Check whether the PE of given version is running.
+ * PrAcc is polled a few times only, as nobody answers
+ * when the target has been reset.
+ */
+static int bitbang_pe_running(bitbang_adapter_t *a, unsigned pe_version)
+{
+    unsigned version;
+
+    bitbang_send(a, 1, 1, 5, ETAP_FASTDATA, 0);       /* Send command. */
+    xfer_fastdata(a, PE_EXEC_VERSION << 16);
+    if (! try_pe_response(a, 8, &version))
+        return 0;
+    return version == (PE_EXEC_VERSION << 16 | pe_version);
+}
+
 /*
  * Download programming executive (PE).
  */
@@ -722,7 +1028,20 @@ static void bitbang_load_executive(adapter_t *adapter,
     const unsigned *pe, unsigned nwords, unsigned pe_version)
 {
     bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
-
+    unsigned code [2 + PIC32_PE_LOADER_LEN * 2];
+    unsigned ninstr;
+
+    /* The PE may still run since a previous download.
+     * Probe it first, as serial execution resets the CPU. */
+    if (! a->serial_execution_mode)
+        bitbang_send(a, 1, 1, 5, TAP_SW_ETAP, 0);   /* Send command. */
+    if (bitbang_pe_running(a, pe_version)) {
+        if (debug_level > 0)
+            fprintf(stderr, "PE already running\n");
+        a->use_executive = 1;
+        a->serial_execution_mode = 1;
+        return;
+    }
     a->use_executive = 1;
     serial_execution(a);
 
@@ -730,34 +1049,33 @@ static void bitbang_load_executive(adapter_t *adapter,
     fflush(stdout);
 
     if (memcmp(a->adapter.family_name, "mz", 2) != 0) {            // steps 1. to 3. not needed for MZ
+        ninstr = 0;
+
         /* Step 1. */
-        xfer_instruction(a, 0x3c04bf88);   // lui a0, 0xbf88
-        xfer_instruction(a, 0x34842000);   // ori a0, 0x2000 - address of BMXCON
-        xfer_instruction(a, 0x3c05001f);   // lui a1, 0x1f
-        xfer_instruction(a, 0x34a50040);   // ori a1, 0x40   - a1 has 001f0040
-        xfer_instruction(a, 0xac850000);   // sw  a1, 0(a0)  - BMXCON initialized
-        printf("1");
-        fflush(stdout);
+        code[ninstr++] = 0x3c04bf88;   // lui a0, 0xbf88
+        code[ninstr++] = 0x34842000;   // ori a0, 0x2000 - address of BMXCON
+        code[ninstr++] = 0x3c05001f;   // lui a1, 0x1f
+        code[ninstr++] = 0x34a50040;   // ori a1, 0x40   - a1 has 001f0040
+        code[ninstr++] = 0xac850000;   // sw  a1, 0(a0)  - BMXCON initialized
 
         /* Step 2. */
-        xfer_instruction(a, 0x34050800);   // li  a1, 0x800  - a1 has 00000800
-        xfer_instruction(a, 0xac850010);   // sw  a1, 16(a0) - BMXDKPBA initialized
-        printf(" 2");
-        fflush(stdout);
+        code[ninstr++] = 0x34050800;   // li  a1, 0x800  - a1 has 00000800
+        code[ninstr++] = 0xac850010;   // sw  a1, 16(a0) - BMXDKPBA initialized
 
         /* Step 3. */
-        xfer_instruction(a, 0x8c850040);   // lw  a1, 64(a0) - load BMXDMSZ
-        xfer_instruction(a, 0xac850020);   // sw  a1, 32(a0) - BMXDUDBA initialized
-        xfer_instruction(a, 0xac850030);   // sw  a1, 48(a0) - BMXDUPBA initialized
-        printf(" 3");
+        code[ninstr++] = 0x8c850040;   // lw  a1, 64(a0) - load BMXDMSZ
+        code[ninstr++] = 0xac850020;   // sw  a1, 32(a0) - BMXDUDBA initialized
+        code[ninstr++] = 0xac850030;   // sw  a1, 48(a0) - BMXDUPBA initialized
+
+        xfer_instructions(a, code, ninstr);
+        printf("1 2 3");
         fflush(stdout);
     }
 
     /* Step 4. */
-    xfer_instruction(a, 0x3c04a000);   // lui a0, 0xa000
-    xfer_instruction(a, 0x34840800);   // ori a0, 0x800  - a0 has a0000800
-    printf(" 4 (LDR)");
-    fflush(stdout);
+    ninstr = 0;
+    code[ninstr++] = 0x3c04a000;       // lui a0, 0xa000
+    code[ninstr++] = 0x34840800;       // ori a0, 0x800  - a0 has a0000800
 
     /* Download the PE loader. */
     int i;
@@ -766,12 +1084,15 @@ static void bitbang_load_executive(adapter_t *adapter,
         unsigned opcode1 = 0x3c060000 | pic32_pe_loader[i];
         unsigned opcode2 = 0x34c60000 | pic32_pe_loader[i+1];
 
-        xfer_instruction(a, opcode1);      // lui a2, PE_loader_hi++
-        xfer_instruction(a, opcode2);      // ori a2, PE_loader_lo++
-        xfer_instruction(a, 0xac860000);   // sw  a2, 0(a0)
-        xfer_instruction(a, 0x24840004);   // addiu a0, 4
+        code[ninstr++] = opcode1;      // lui a2, PE_loader_hi++
+        code[ninstr++] = opcode2;      // ori a2, PE_loader_lo++
+        code[ninstr++] = 0xac860000;   // sw  a2, 0(a0)
+        code[ninstr++] = 0x24840004;   // addiu a0, 4
     }
-    printf(" 5");
+
+    // steps 4. and 5. are restartable, as a0 is reloaded at step 4.
+    xfer_instructions(a, code, ninstr);
+    printf(" 4 (LDR) 5");
     fflush(stdout);
 
     /* Jump to PE loader (step 6). */
@@ -800,9 +1121,7 @@ static void bitbang_load_executive(adapter_t *adapter,
     fflush(stdout);
 
     /* Download the PE itself (step 7-B). */
-    for (i = 0; i < nwords; i++) {
-        xfer_fastdata(a, *pe++);
-    }
+    xfer_fastdata_array(a, pe, nwords);
     bitbang_delay10mS(a, 3);
     printf(" 7b");
     fflush(stdout);
@@ -939,10 +1258,7 @@ static void bitbang_program_row(adapter_t *adapter, unsigned addr,
     //
 
     /* Download data. */
-    int i;
-    for (i = 0; i < words_per_row; i++) {
-        xfer_fastdata(a, *data++);               /* Send word. */
-    }
+    xfer_fastdata_array(a, data, words_per_row);
 
     unsigned response = get_pe_response(a);
     if (response != (PE_ROW_PROGRAM << 16)) {
@@ -953,18 +1269,88 @@ static void bitbang_program_row(adapter_t *adapter, unsigned addr,
 }
 
 /*
- * Verify a block of memory.
+ * Program a number of whole rows of flash memory,
+ * with a single command and a single response.
  */
-static void bitbang_verify_data(adapter_t *adapter,
-    unsigned addr, unsigned nwords, unsigned *data)
+static void bitbang_program_cluster(adapter_t *adapter, unsigned addr,
+    unsigned *data, unsigned nwords, unsigned words_per_row)
 {
     bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
-    unsigned data_crc, flash_crc;
+    unsigned i;
 
     if (DBG2)
-        fprintf(stderr, "verify_data\n");
-    if (DBG3)
-        fprintf(stderr, "\nverifying %u words at %08x ", nwords, addr);
+        fprintf(stderr, "program_cluster\n");
+    if (debug_level > 0)
+        fprintf(stderr, "cluster program %u words at %08x\n", nwords, addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "slow flash write not implemented yet\n");
+        exit(-1);
+    }
+
+    /* Use PE to write flash memory. */
+    bitbang_send(a, 1, 1, 5, ETAP_FASTDATA, 0);  /* Send command. */
+    xfer_fastdata(a, PE_PROGRAM_CLUSTER << 16);
+    xfer_fastdata(a, addr);                      /* Send address. */
+    xfer_fastdata(a, nwords * 4);                /* Send length in bytes. */
+
+    /* Download data, row by row.
+     * The PE writes a row before it takes the next one, so the
+     * first word of every next row waits until the PE is ready. */
+    for (i = 0; i < nwords; i += words_per_row) {
+        if (i > 0)
+            xfer_fastdata_sync(a, data[i]);
+        else
+            xfer_fastdata(a, data[i]);
+        xfer_fastdata_array(a, data + i + 1, words_per_row - 1);
+    }
+
+    unsigned response = get_pe_response(a);
+    if (response != (PE_PROGRAM_CLUSTER << 16)) {
+        fprintf(stderr, "\nfailed to program cluster at %08x, reply = %08x\n",
+                                                         addr,         response);
+        exit(-1);
+    }
+}
+
+/*
+ * Erase a range of flash pages.
+ */
+static void bitbang_erase_page(adapter_t *adapter, unsigned addr, unsigned npages)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+
+    if (DBG2)
+        fprintf(stderr, "erase_page\n");
+
+    if (debug_level > 0)
+        fprintf(stderr, "erase %u pages at %08x\n", npages, addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "slow page erase not implemented yet\n");
+        exit(-1);
+    }
+
+    /* Use PE to erase flash memory. */
+    bitbang_send(a, 1, 1, 5, ETAP_FASTDATA, 0);  /* Send command. */
+    xfer_fastdata(a, PE_PAGE_ERASE << 16 | npages);
+    xfer_fastdata(a, addr);                      /* Send address. */
+
+    unsigned response = get_pe_response(a);
+    if (response != (PE_PAGE_ERASE << 16)) {
+        fprintf(stderr, "\nfailed to erase %u pages at %08x, reply = %08x\n",
+                                              npages,     addr,       response);
+        exit(-1);
+    }
+}
+
+/*
+ * Get CRC of a block of memory.
+ */
+static unsigned bitbang_get_crc(adapter_t *adapter,
+    unsigned addr, unsigned nbytes)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
 
     if (! a->use_executive) {
         /* Without PE. */
@@ -976,16 +1362,64 @@ static void bitbang_verify_data(adapter_t *adapter,
     bitbang_send(a, 1, 1, 5, ETAP_FASTDATA, 0);  /* Send command. */
     xfer_fastdata(a, PE_GET_CRC << 16);
     xfer_fastdata(a, addr);                      /* Send address. */
-    xfer_fastdata(a, nwords * 4);                /* Send length. */
+    xfer_fastdata(a, nbytes);                    /* Send length. */
 
     unsigned response = get_pe_response(a);
     if (response != (PE_GET_CRC << 16)) {
-        fprintf(stderr, "\nfailed to verify %d words at %08x, reply = %08x\n",
-                                             nwords,     addr,       response);
+        fprintf(stderr, "\nfailed to get crc of %d bytes at %08x, reply = %08x\n",
+                                                 nbytes,     addr,       response);
+        exit(-1);
+    }
+    return get_pe_response(a) & 0xffff;
+}
+
+/*
+ * Check that a block of memory is erased.
+ * Return 1 when all bytes are 0xFF.
+ */
+static int bitbang_blank_check(adapter_t *adapter,
+    unsigned addr, unsigned nbytes)
+{
+    bitbang_adapter_t *a = (bitbang_adapter_t*) adapter;
+
+    if (DBG2)
+        fprintf(stderr, "blank_check\n");
+
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "slow blank check not implemented yet\n");
         exit(-1);
     }
 
-    flash_crc = get_pe_response(a) & 0xffff;
+    /* Use PE to check flash memory. */
+    bitbang_send(a, 1, 1, 5, ETAP_FASTDATA, 0);  /* Send command. */
+    xfer_fastdata(a, PE_BLANK_CHECK << 16);
+    xfer_fastdata(a, addr);                      /* Send address. */
+    xfer_fastdata(a, nbytes);                    /* Send length. */
+
+    unsigned response = get_pe_response(a);
+    if ((response >> 16) != PE_BLANK_CHECK) {
+        fprintf(stderr, "\nfailed to check %d bytes at %08x, reply = %08x\n",
+                                            nbytes,     addr,       response);
+        exit(-1);
+    }
+    return (response & 0xffff) == 0;             /* response code 0 = blank */
+}
+
+/*
+ * Verify a block of memory.
+ */
+static void bitbang_verify_data(adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
+{
+    unsigned data_crc, flash_crc;
+
+    if (DBG2)
+        fprintf(stderr, "verify_data\n");
+    if (DBG3)
+        fprintf(stderr, "\nverifying %u words at %08x ", nwords, addr);
+
+    flash_crc = bitbang_get_crc(adapter, addr, nwords * 4);
 
     data_crc = calculate_crc(0xffff, (unsigned char*) data, nwords * 4);
     if (flash_crc != data_crc) {
@@ -1201,9 +1635,15 @@ adapter_t *adapter_open_bitbang(const char *port, int baud_rate)
     serial_write(&ch, 1);
     n = serial_read(buffer, 14, 250);
 
-    if (n == 14 && memcmp(buffer, "ascii ICSP v1", 13) == 0)
+    if (n == 14 && memcmp(buffer, "ascii ICSP v1", 13) == 0) {
         printf(" OK2 - %s\n", buffer);
-    else {
+
+        // version 1F and later accept binary FASTDATA words
+        a->BinaryFastData = (buffer[13] >= 'F');
+
+        // version 1G and later accept repeated FASTDATA words
+        a->RepeatFastData = (buffer[13] >= 'G');
+    } else {
         fprintf(stderr, "\nBad response from 'ascii ICSP' adapter\n");
         serial_close();
         free(a);
@@ -1216,7 +1656,8 @@ adapter_t *adapter_open_bitbang(const char *port, int baud_rate)
 
     a->BitsToRead = 0;
     a->CharToRead = 0;
-    a->PendingHandshake = 0;               // handshake read req'd before next write
+    a->PendingSyncs = 0;                   // no '<' replies outstanding
+    a->QueuedChars = 0;                    // no speculative reads pending
 
     a->TotalCodeChrsSent = 0;              // count of total # of code characters sent out
     a->TotalCodeChrsRecv = 0;              // count of total # of code characters received
@@ -1228,6 +1669,7 @@ adapter_t *adapter_open_bitbang(const char *port, int baud_rate)
     a->WriteCount = 0;
     a->Read1Count = 0;
     a->Read2Count = 0;
+    a->SyncCount = 0;
     a->FDataCount = 0;
     for (i = 0; i < 4; i++)
         a->DelayCount[i] = 0;
@@ -1260,6 +1702,7 @@ adapter_t *adapter_open_bitbang(const char *port, int baud_rate)
             bitbang_send(a, 0, 0, 8, MCHP_DEASSERT_RST, 0); // PIC32MZ devices only.
         bitbang_delay10mS(a, 0);
         bitbang_send(a, 0, 0, 8, MCHP_STATUS, 1);       /* Xfer data. */
+        serial_flush();
         usleep(1000000);                                // allow 1 second for erase to complete
         bitbang_ICSP_enable(a, 0);                      // shut down target
         serial_close();
@@ -1331,7 +1774,11 @@ adapter_t *adapter_open_bitbang(const char *port, int baud_rate)
     a->adapter.read_data = bitbang_read_data;
     a->adapter.verify_data = bitbang_verify_data;
     a->adapter.erase_chip = bitbang_erase_chip;
+    a->adapter.erase_page = bitbang_erase_page;
+    a->adapter.get_crc = bitbang_get_crc;
+    a->adapter.blank_check = bitbang_blank_check;
     a->adapter.program_word = bitbang_program_word;
     a->adapter.program_row = bitbang_program_row;
+    a->adapter.program_cluster = bitbang_program_cluster;
     return &a->adapter;
 }
@@ -17,6 +17,7 @@
 #include "adapter.h"
 #include "hidapi.h"
 #include "pic32.h"
+#include "stats.h"
 
 /* Bootloader commands */
 #define CMD_QUERY_DEVICE        0x02
@@ -73,7 +74,9 @@ static void hidboot_command(hidboot_adapter_t *a, unsigned char cmd,
         }
         fprintf(stderr, "\n");
     }
+    unsigned long long t0 = stats_time();
     hid_write(a->hiddev, buf, 64);
+    stats_event(STAT_USB_OUT, 64, t0);
 
     if (cmd != CMD_QUERY_DEVICE && cmd != CMD_GET_DATA) {
         /* No reply expected. */
@@ -81,7 +84,9 @@ static void hidboot_command(hidboot_adapter_t *a, unsigned char cmd,
     }
 
     memset(a->reply, 0, sizeof(a->reply));
+    t0 = stats_time();
     a->reply_len = hid_read_timeout(a->hiddev, a->reply, 64, 4000);
+    stats_event(STAT_USB_IN, a->reply_len > 0 ? a->reply_len : 0, t0);
     if (a->reply_len == 0) {
         fprintf(stderr, "Timed out.\n");
         exit(-1);
@@ -178,6 +183,8 @@ static void program_flash(hidboot_adapter_t *a,
     //    nbytes, addr, data[0], data[1], data[nwords-1]);
 
     nbytes = nwords * 4;
+    if (adapter_is_blank(data, nbytes))
+        return;
     if (addr < a->adapter.user_start ||
         addr + nbytes >= a->adapter.user_start + a->adapter.user_nbytes)
     {
@@ -28,6 +28,20 @@
 
 #include "adapter.h"
 #include "pic32.h"
+#include "crc.h"
+#include "stats.h"
+
+/*
+ * Number of asynchronous USB transfers in flight.
+ */
+#define NTRANSFERS  4
+
+/*
+ * Limit of PrAcc polls while waiting for the PE.
+ * Longest PE commands (erase, CRC or blank check of large areas)
+ * take a few seconds at most.
+ */
+#define PE_RESPONSE_POLLS   100000
 
 typedef struct {
     uint16_t vid;
@@ -58,9 +72,18 @@ typedef struct {
     unsigned char output [256*16];
     int bytes_to_write;
 
+    /* Ring of asynchronous transfers: while one buffer is being
+     * clocked out by the adapter, the next one can be filled. */
+    struct libusb_transfer *transfer [NTRANSFERS];
+    unsigned char transfer_buf [NTRANSFERS] [256*16];
+    int transfer_busy [NTRANSFERS];
+    int transfer_failed;
+    int next_transfer;
+
     /* Receive buffer. */
-    unsigned char input [64];
+    unsigned char input [64*16 + 8];
     int bytes_to_read;
+    int max_packet_size;
     int bytes_per_word;
     unsigned long long fix_high_bit;
     unsigned long long high_byte_mask;
@@ -75,10 +98,27 @@ typedef struct {
     unsigned extra_output;
 
     unsigned mhz;
+    int khz;                        /* Current TCK rate */
+    int auto_khz;                   /* Tune TCK rate, lower it on errors */
+    int tck_limit;                  /* Index of highest rate for IDCODE */
+    int pe_tuned;                   /* Rate checked by PE round trips */
     unsigned use_executive;
     unsigned serial_execution_mode;
+    unsigned assume_ready;          /* Don't wait for PrAcc in serial execution */
 } mpsse_adapter_t;
 
+/*
+ * TCK rate in kHz, from -J option: 0 for default, -1 for auto.
+ */
+extern int jtag_khz;
+
+/*
+ * Steps of TCK rate for auto tuning, in kHz.
+ */
+static const int tck_rates[] = {
+    500, 1000, 2000, 3000, 5000, 6000, 10000, 15000, 30000, 0
+};
+
 /*
  * Identifiers of USB adapter.
  */
@@ -151,33 +191,12 @@ static const device_t devlist[] = {
     { 0 }
 };
 
-/*
- * Calculate checksum.
- */
-static unsigned calculate_crc(unsigned crc, unsigned char *data, unsigned nbytes)
-{
-    static const unsigned short crc_table [16] = {
-        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
-        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
-    };
-    unsigned i;
-
-    while (nbytes--) {
-        i = (crc >> 12) ^ (*data >> 4);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        i = (crc >> 12) ^ (*data >> 0);
-        crc = crc_table[i & 0x0F] ^ (crc << 4);
-        data++;
-    }
-    return crc & 0xffff;
-}
-
 /*
  * Send a packet to USB device.
  */
 static void bulk_write(mpsse_adapter_t *a, unsigned char *output, int nbytes)
 {
-    int bytes_written;
+    int bytes_written = 0;
 
     if (debug_level > 1) {
         int i;
@@ -187,8 +206,10 @@ static void bulk_write(mpsse_adapter_t *a, unsigned char *output, int nbytes)
         fprintf(stderr, "\n");
     }
 
+    unsigned long long t0 = stats_time();
     int ret = libusb_bulk_transfer(a->usbdev, IN_EP, (unsigned char*) output,
         nbytes, &bytes_written, 1000);
+    stats_event(STAT_USB_OUT, bytes_written, t0);
 
     if (ret != 0) {
         fprintf(stderr, "usb bulk write failed: %d: %s\n",
@@ -200,28 +221,162 @@ static void bulk_write(mpsse_adapter_t *a, unsigned char *output, int nbytes)
             bytes_written, nbytes);
 }
 
+/*
+ * Callback for completion of asynchronous transfer.
+ */
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *transfer)
+{
+    mpsse_adapter_t *a = transfer->user_data;
+    int i;
+
+    for (i=0; i<NTRANSFERS; i++) {
+        if (a->transfer[i] == transfer) {
+            a->transfer_busy[i] = 0;
+            break;
+        }
+    }
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "usb bulk write failed: status %d\n",
+            transfer->status);
+        a->transfer_failed = 1;
+    } else if (transfer->actual_length != transfer->length) {
+        fprintf(stderr, "usb bulk written %d bytes of %d",
+            transfer->actual_length, transfer->length);
+    }
+}
+
+/*
+ * Wait until the given transfer slot is released.
+ */
+static void wait_transfer(mpsse_adapter_t *a, int i)
+{
+    while (a->transfer_busy[i]) {
+        int ret = libusb_handle_events_completed(a->context, NULL);
+        if (ret != 0) {
+            fprintf(stderr, "usb event handling failed: %d: %s\n",
+                ret, libusb_strerror(ret));
+            exit(-1);
+        }
+    }
+    if (a->transfer_failed)
+        exit(-1);
+}
+
+/*
+ * Wait until all asynchronous transfers are completed.
+ */
+static void wait_all_transfers(mpsse_adapter_t *a)
+{
+    int i;
+
+    for (i=0; i<NTRANSFERS; i++)
+        wait_transfer(a, i);
+}
+
+/*
+ * Send a packet to USB device, without waiting for completion.
+ * Transfers on the same endpoint are executed in order,
+ * so a subsequent read gets a reply for all data sent before.
+ * Fall back to synchronous write when async transfers
+ * are not available.
+ */
+static void bulk_write_async(mpsse_adapter_t *a, unsigned char *output, int nbytes)
+{
+    int i = a->next_transfer;
+
+    if (! a->transfer[i]) {
+        bulk_write(a, output, nbytes);
+        return;
+    }
+    if (debug_level > 1) {
+        int k;
+        fprintf(stderr, "usb async write %d bytes:", nbytes);
+        for (k=0; k<nbytes; k++)
+            fprintf(stderr, "%c%02x", k ? '-' : ' ', output[k]);
+        fprintf(stderr, "\n");
+    }
+
+    /* Get a free buffer. */
+    wait_transfer(a, i);
+    memcpy(a->transfer_buf[i], output, nbytes);
+    libusb_fill_bulk_transfer(a->transfer[i], a->usbdev, IN_EP,
+        a->transfer_buf[i], nbytes, transfer_done, a, 1000);
+
+    a->transfer_busy[i] = 1;
+    stats_event(STAT_USB_OUT, nbytes, 0);
+    int ret = libusb_submit_transfer(a->transfer[i]);
+    if (ret != 0) {
+        fprintf(stderr, "usb bulk write failed: %d: %s\n",
+            ret, libusb_strerror(ret));
+        exit(-1);
+    }
+    a->next_transfer = (i + 1) % NTRANSFERS;
+}
+
+/*
+ * Allocate a ring of asynchronous transfers.
+ */
+static void alloc_transfers(mpsse_adapter_t *a)
+{
+    int i;
+
+    for (i=0; i<NTRANSFERS; i++) {
+        a->transfer[i] = libusb_alloc_transfer(0);
+        if (! a->transfer[i]) {
+            /* Use synchronous mode. */
+            while (--i >= 0) {
+                libusb_free_transfer(a->transfer[i]);
+                a->transfer[i] = 0;
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Release all asynchronous transfers.
+ */
+static void free_transfers(mpsse_adapter_t *a)
+{
+    int i;
+
+    wait_all_transfers(a);
+    for (i=0; i<NTRANSFERS; i++) {
+        if (a->transfer[i]) {
+            libusb_free_transfer(a->transfer[i]);
+            a->transfer[i] = 0;
+        }
+    }
+}
+
 /*
  * If there are any data in transmit buffer -
  * send them to device.
+ * When no reply is expected, return without waiting:
+ * the adapter shifts out the data while we prepare the next packet.
  */
 static void mpsse_flush_output(mpsse_adapter_t *a)
 {
     int bytes_read, n;
-    unsigned char reply [64];
+    unsigned char reply [512];
 
     if (a->bytes_to_write <= 0)
         return;
 
-    bulk_write(a, a->output, a->bytes_to_write);
+    bulk_write_async(a, a->output, a->bytes_to_write);
     a->bytes_to_write = 0;
     if (a->bytes_to_read <= 0)
         return;
 
-    /* Get reply. */
+    /* Get reply.
+     * Every USB packet starts with two bytes of modem status,
+     * so always ask for a whole packet and strip the status. */
     bytes_read = 0;
     while (bytes_read < a->bytes_to_read) {
+        unsigned long long t0 = stats_time();
         int ret = libusb_bulk_transfer(a->usbdev, OUT_EP, (unsigned char*) reply,
-            a->bytes_to_read - bytes_read + 2, &n, 2000);
+            a->max_packet_size, &n, 2000);
+        stats_event(STAT_USB_IN, ret ? 0 : n, t0);
         if (ret != 0) {
             fprintf(stderr, "usb bulk read failed\n");
             exit(-1);
@@ -240,6 +395,8 @@ static void mpsse_flush_output(mpsse_adapter_t *a)
         }
         if (n > 2) {
             /* Copy data. */
+            if (n - 2 > sizeof(a->input) - bytes_read)
+                n = sizeof(a->input) - bytes_read + 2;
             memcpy(a->input + bytes_read, reply + 2, n - 2);
             bytes_read += n - 2;
         }
@@ -455,6 +612,7 @@ static void mpsse_speed(mpsse_adapter_t *a, int khz)
     output [2] = divisor >> 8;
     bulk_write(a, output, 3);
 
+    a->khz = khz;
     if (debug_level) {
         khz = (a->mhz * 2000 / (divisor + 1) + 1) / 2;
         fprintf(stderr, "%s: clock rate %.1f MHz\n", a->name, khz / 1000.0);
@@ -481,6 +639,7 @@ static void mpsse_close(adapter_t *adapter, int power_on)
     mdelay(100);    /* Hold in reset for a bit, so it auto-runs afterwards */
     mpsse_reset(a, 0, 0, 0);
 
+    free_transfers(a);
     libusb_release_interface(a->usbdev, 0);
     libusb_close(a->usbdev);
     free(a);
@@ -506,6 +665,55 @@ static unsigned mpsse_get_idcode(adapter_t *adapter)
     return idcode;
 }
 
+/*
+ * Find the highest TCK rate, at which IDCODE is read reliably.
+ * It is an upper limit for the PE check in mpsse_tune_pe_speed().
+ * Use one step lower, to have a safety margin.
+ */
+static void mpsse_tune_speed(mpsse_adapter_t *a, unsigned idcode)
+{
+    int i, k, best = 0;
+
+    for (i=1; tck_rates[i] && tck_rates[i] <= (int)a->mhz * 500; i++) {
+        mpsse_speed(a, tck_rates[i]);
+        for (k=0; k<16; k++) {
+            if (mpsse_get_idcode(&a->adapter) != idcode)
+                break;
+        }
+        if (k < 16)
+            break;
+        best = i;
+    }
+    a->tck_limit = best;
+    if (best > 0)
+        best--;
+    mpsse_speed(a, tck_rates[best]);
+    if (debug_level > 0)
+        fprintf(stderr, "%s: auto TCK rate %d kHz\n", a->name, a->khz);
+}
+
+/*
+ * In auto mode, lower TCK rate by one step after a transfer error.
+ * Only for requests without side effects, which can be repeated:
+ * programming errors are fatal.
+ * Return 0 when not possible.
+ */
+static int mpsse_slow_down(mpsse_adapter_t *a)
+{
+    int i;
+
+    if (! a->auto_khz)
+        return 0;
+    for (i=0; tck_rates[i] && tck_rates[i] < a->khz; i++)
+        continue;
+    if (i == 0)
+        return 0;
+    mpsse_speed(a, tck_rates[i-1]);
+    fprintf(stderr, "%s: transfer error, TCK rate lowered to %d kHz\n",
+        a->name, a->khz);
+    return 1;
+}
+
 /*
  * Put device to serial execution mode.
  */
@@ -611,6 +819,28 @@ static void xfer_fastdata(mpsse_adapter_t *a, unsigned word)
                     0);
 }
 
+/*
+ * Send a word by FASTDATA, and wait until the PE takes it.
+ * While a row is being written, the PE does not read FASTDATA:
+ * the word is rejected with PrAcc bit cleared, and is sent again.
+ */
+static void xfer_fastdata_sync(mpsse_adapter_t *a, unsigned word)
+{
+    unsigned i;
+
+    for (i=0; i<PE_RESPONSE_POLLS; i++) {
+        mpsse_send(a, TMS_HEADER_XFERDATAFAST_NBITS, TMS_HEADER_XFERDATAFAST_VAL,
+                        33, (unsigned long long) word << 1,
+                        TMS_FOOTER_XFERDATAFAST_NBITS, TMS_FOOTER_XFERDATAFAST_VAL,
+                        1);
+        if (mpsse_recv(a) & 1)
+            return;
+        stats_event(STAT_PRACC_POLL, 0, 0);
+    }
+    fprintf(stderr, "%s: PE does not accept data\n", a->name);
+    exit(-1);
+}
+
 static void xfer_instruction(mpsse_adapter_t *a, unsigned instruction)
 {
     unsigned ctl;
@@ -633,6 +863,7 @@ static void xfer_instruction(mpsse_adapter_t *a, unsigned instruction)
                         TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
                         1);
         ctl = mpsse_recv(a);
+        stats_event(STAT_PRACC_POLL, 0, 0);
     } while (! (ctl & CONTROL_PRACC));
 
     // Select Data Register
@@ -661,9 +892,138 @@ static void xfer_instruction(mpsse_adapter_t *a, unsigned instruction)
                     0);
 }
 
-static unsigned get_pe_response(mpsse_adapter_t *a)
+/*
+ * Maximum number of instructions in one speculative batch:
+ * about 90 bytes of MPSSE commands per instruction.
+ */
+#define MAX_BATCH_INSTRUCTIONS  40
+
+/*
+ * Check whether the instruction is a store to memory.
+ */
+static int is_store(unsigned instruction)
+{
+    unsigned opcode = instruction >> 26;
+
+    return (opcode & 0x38) == 0x28 || (opcode & 0x38) == 0x38;
+}
+
+/*
+ * Send a sequence of instructions without waiting for the CPU.
+ * Control register is captured for every instruction,
+ * and all Processor Access bits are checked at the end of a batch.
+ * When the CPU was not ready, the next instructions of the batch may
+ * run with registers not loaded yet. So every store starts a new
+ * batch: it runs only after all previous instructions are confirmed.
+ * Return 0 when the CPU was not ready for some instruction.
+ */
+static int xfer_instructions_fast(mpsse_adapter_t *a,
+    const unsigned *code, unsigned ninstr)
 {
-    unsigned ctl, response;
+    unsigned long long word;
+    unsigned char *input;
+    unsigned i, k, n, ctl;
+
+    for (i=0; i<ninstr; i+=n) {
+        for (n=1; i+n < ninstr && n < MAX_BATCH_INSTRUCTIONS; n++)
+            if (is_store(code[i+n]))
+                break;
+
+        /* Start with an empty buffer, to fit the whole batch. */
+        mpsse_flush_output(a);
+        for (k=0; k<n; k++) {
+            if (debug_level > 1)
+                fprintf(stderr, "%s: xfer instruction %08x\n", a->name, code[i+k]);
+
+            // Select Control Register
+            /* Send command. */
+            mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                            ETAP_COMMAND_NBITS, ETAP_CONTROL,
+                            TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                            0);
+            /* Get control, check PrAcc later. */
+            mpsse_send(a, TMS_HEADER_XFERDATA_NBITS, TMS_HEADER_XFERDATA_VAL,
+                            32, CONTROL_PRACC |CONTROL_PROBEN |CONTROL_PROBTRAP | CONTROL_EJTAGBRK,
+                            TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
+                            1);
+
+            // Select Data Register
+            // Send the instruction
+            /* Send command. */
+            mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                            ETAP_COMMAND_NBITS, ETAP_DATA,
+                            TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                            0);
+            /* Send data. */
+            mpsse_send(a, TMS_HEADER_XFERDATA_NBITS, TMS_HEADER_XFERDATA_VAL,
+                            32, code[i+k],
+                            TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
+                            0);
+
+            // Tell CPU to execute instruction
+            /* Send command. */
+            mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                            ETAP_COMMAND_NBITS, ETAP_CONTROL,
+                            TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                            0);
+            /* Send data. */
+            mpsse_send(a, TMS_HEADER_XFERDATA_NBITS, TMS_HEADER_XFERDATA_VAL,
+                            32, CONTROL_PROBEN | CONTROL_PROBTRAP,
+                            TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
+                            0);
+        }
+        mpsse_flush_output(a);
+
+        /* Check Processor Access bits. */
+        input = a->input;
+        for (k=0; k<n; k++) {
+            memcpy(&word, input, sizeof(word));
+            input += a->bytes_per_word;
+            ctl = mpsse_fix_data(a, word);
+            if (! (ctl & CONTROL_PRACC)) {
+                if (debug_level > 0)
+                    fprintf(stderr, "%s: CPU not ready for instruction %08x\n",
+                        a->name, code[i+k]);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Execute a sequence of instructions in serial execution mode.
+ * The sequence must be restartable: when the CPU happens to be
+ * not ready, the whole sequence is repeated in slow mode,
+ * polling PrAcc before every instruction.
+ */
+static void xfer_instructions(mpsse_adapter_t *a,
+    const unsigned *code, unsigned ninstr)
+{
+    unsigned i;
+
+    if (a->assume_ready) {
+        if (xfer_instructions_fast(a, code, ninstr))
+            return;
+
+        /* Don't speculate anymore on this target. */
+        a->assume_ready = 0;
+        if (debug_level > 0)
+            fprintf(stderr, "%s: switching to slow serial execution\n", a->name);
+    }
+    for (i=0; i<ninstr; i++)
+        xfer_instruction(a, code[i]);
+}
+
+/*
+ * Wait for a PE response, polling PrAcc at most maxpolls times,
+ * or forever when maxpolls is 0.
+ * Return 0 on timeout.
+ */
+static int try_pe_response(mpsse_adapter_t *a, unsigned maxpolls,
+    unsigned *response)
+{
+    unsigned ctl;
 
     // Select Control Register
     /* Send command. */
@@ -680,6 +1040,9 @@ static unsigned get_pe_response(mpsse_adapter_t *a)
                         TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
                         1);
         ctl = mpsse_recv(a);
+        stats_event(STAT_PRACC_POLL, 0, 0);
+        if (! (ctl & CONTROL_PRACC) && maxpolls > 0 && --maxpolls == 0)
+            return 0;
     } while (! (ctl & CONTROL_PRACC));
 
     // Select Data Register
@@ -694,7 +1057,7 @@ static unsigned get_pe_response(mpsse_adapter_t *a)
                     32, 0,
                     TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
                     1);
-    response = mpsse_recv(a);
+    *response = mpsse_recv(a);
 
     // Tell CPU to execute NOP instruction
     /* Send command. */
@@ -708,10 +1071,118 @@ static unsigned get_pe_response(mpsse_adapter_t *a)
                     TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
                     0);
     if (debug_level > 1)
-        fprintf(stderr, "%s: get PE response %08x\n", a->name, response);
+        fprintf(stderr, "%s: get PE response %08x\n", a->name, *response);
+    return 1;
+}
+
+/*
+ * Wait for a PE response, with a limit of PE_RESPONSE_POLLS.
+ */
+static unsigned get_pe_response(mpsse_adapter_t *a)
+{
+    unsigned response;
+
+    if (! try_pe_response(a, PE_RESPONSE_POLLS, &response)) {
+        fprintf(stderr, "%s: no response from PE\n", a->name);
+        exit(-1);
+    }
     return response;
 }
 
+/*
+ * Queue a request for PE response, without waiting for a reply.
+ * Both the Control register (to check the Processor Access bit)
+ * and the Data register are captured into the receive buffer.
+ * The final write of PrAcc=0 is unconditional, so the Control
+ * register is captured once more by it: when PrAcc was not set
+ * before but is set there, the access was completed without
+ * reading it, and the response is lost.
+ */
+static void queue_pe_response(mpsse_adapter_t *a)
+{
+    // Select Control Register
+    /* Send command. */
+    mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                    ETAP_COMMAND_NBITS, ETAP_CONTROL,
+                    TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                    0);
+    /* Get control. */
+    mpsse_send(a, TMS_HEADER_XFERDATA_NBITS, TMS_HEADER_XFERDATA_VAL,
+                    32, CONTROL_PRACC |CONTROL_PROBEN |CONTROL_PROBTRAP | CONTROL_EJTAGBRK,
+                    TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
+                    1);
+
+    // Select Data Register
+    /* Send command. */
+    mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                    ETAP_COMMAND_NBITS, ETAP_DATA,
+                    TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                    0);
+    /* Get data. */
+    mpsse_send(a, TMS_HEADER_XFERDATA_NBITS, TMS_HEADER_XFERDATA_VAL,
+                    32, 0,
+                    TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
+                    1);
+
+    // Tell CPU to execute NOP instruction
+    /* Send command. */
+    mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                    ETAP_COMMAND_NBITS, ETAP_CONTROL,
+                    TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                    0);
+    /* Send data, get control. */
+    mpsse_send(a, TMS_HEADER_XFERDATA_NBITS, TMS_HEADER_XFERDATA_VAL,
+                    32, CONTROL_PROBEN | CONTROL_PROBTRAP,
+                    TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
+                    1);
+}
+
+/*
+ * Get a batch of PE responses, queued by queue_pe_response(),
+ * in one USB round trip.  Responses with Processor Access bit
+ * not set are dropped: the PE was not ready yet.
+ * Return a number of valid words stored into the data array;
+ * the rest should be received by get_pe_response().
+ * A number of lost responses is stored to *nlost: the caller
+ * has to drain the rest and repeat the request on the slow path.
+ */
+static unsigned get_pe_responses(mpsse_adapter_t *a,
+    unsigned *data, unsigned nresponses, unsigned *nlost)
+{
+    unsigned long long word, clear;
+    unsigned char *input;
+    unsigned i, ctl, nvalid;
+
+    mpsse_flush_output(a);
+
+    /* Every response consists of three words:
+     * control, data and control at PrAcc clear. */
+    input = a->input;
+    nvalid = 0;
+    *nlost = 0;
+    for (i=0; i<nresponses; i++) {
+        memcpy(&word, input, sizeof(word));
+        ctl = mpsse_fix_data(a, word);
+        input += a->bytes_per_word;
+
+        memcpy(&word, input, sizeof(word));
+        input += a->bytes_per_word;
+
+        memcpy(&clear, input, sizeof(clear));
+        input += a->bytes_per_word;
+        if (! (ctl & CONTROL_PRACC)) {
+            if (mpsse_fix_data(a, clear) & CONTROL_PRACC)
+                ++*nlost;
+            continue;
+        }
+        data[nvalid++] = mpsse_fix_data(a, word);
+    }
+    if (debug_level > 1)
+        fprintf(stderr, "%s: get %u PE responses of %u, %u lost\n",
+            a->name, nvalid, nresponses, *nlost);
+    return nvalid;
+}
+
 /*
  * Read a word from memory (without PE).
  */
@@ -721,14 +1192,18 @@ static unsigned mpsse_read_word(adapter_t *adapter, unsigned addr)
     unsigned addr_lo = addr & 0xFFFF;
     unsigned addr_hi = (addr >> 16) & 0xFFFF;
 
+    unsigned code[5] = {
+        0x3c04bf80,                             // lui s3, 0xFF20
+        0x3c080000 | addr_hi,                   // lui t0, addr_hi
+        0x35080000 | addr_lo,                   // ori t0, addr_lo
+        0x8d090000,                             // lw t1, 0(t0)
+        0xae690000,                             // sw t1, 0(s3)
+    };
+
     serial_execution(a);
 
     //fprintf(stderr, "%s: read word from %08x\n", a->name, addr);
-    xfer_instruction(a, 0x3c04bf80);            // lui s3, 0xFF20
-    xfer_instruction(a, 0x3c080000 | addr_hi);  // lui t0, addr_hi
-    xfer_instruction(a, 0x35080000 | addr_lo);  // ori t0, addr_lo
-    xfer_instruction(a, 0x8d090000);            // lw t1, 0(t0)
-    xfer_instruction(a, 0xae690000);            // sw t1, 0(s3)
+    xfer_instructions(a, code, 5);
 
     /* Send command. */
     mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
@@ -754,14 +1229,43 @@ static void mpsse_read_data(adapter_t *adapter,
     unsigned addr, unsigned nwords, unsigned *data)
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
-    unsigned words_read, i;
+    unsigned words_read, i, n, nlost, reply [33];
 
     //fprintf(stderr, "%s: read %d bytes from %08x\n", a->name, nwords*4, addr);
     if (! a->use_executive) {
-        /* Without PE. */
-        for (; nwords > 0; nwords--) {
-            *data++ = mpsse_read_word(adapter, addr);
-            addr += 4;
+        /* Without PE: load the address once, then every
+         * word needs only a load and a store to FASTDATA. */
+        unsigned code[3] = {
+            0x3c04bf80,                         // lui s3, 0xFF20
+            0x3c080000 | (addr >> 16),          // lui t0, addr_hi
+            0x35080000 | (addr & 0xFFFF),       // ori t0, addr_lo
+        };
+
+        serial_execution(a);
+        xfer_instructions(a, code, 3);
+        for (i=0; i<nwords; i++) {
+            unsigned fetch[2] = {
+                0x8d090000 | ((i & 0x1fff) * 4), // lw t1, offset(t0)
+                0xae690000,                     // sw t1, 0(s3)
+            };
+            if (i > 0 && (i & 0x1fff) == 0) {
+                /* Offset of lw is positive 15-bit: advance t0. */
+                code[1] = 0x3c080000 | ((addr + i*4) >> 16);
+                code[2] = 0x35080000 | ((addr + i*4) & 0xFFFF);
+                xfer_instructions(a, code + 1, 2);
+            }
+            xfer_instructions(a, fetch, 2);
+
+            /* Get fastdata. */
+            mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                            ETAP_COMMAND_NBITS, ETAP_FASTDATA,
+                            TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                            0);
+            mpsse_send(a, TMS_HEADER_XFERDATAFAST_NBITS, TMS_HEADER_XFERDATAFAST_VAL,
+                            33, 0,
+                            TMS_FOOTER_XFERDATAFAST_NBITS, TMS_FOOTER_XFERDATAFAST_VAL,
+                            1);
+            data[i] = mpsse_recv(a) >> 1;
         }
         return;
     }
@@ -776,19 +1280,93 @@ static void mpsse_read_data(adapter_t *adapter,
         xfer_fastdata(a, PE_READ << 16 | 32);       /* Read 32 words */
         xfer_fastdata(a, addr);                     /* Address */
 
-        unsigned response = get_pe_response(a);     /* Get response */
-        if (response != PE_READ << 16) {
+        /* Get response and 32 words of data in one transaction.
+         * The PE fetches words much faster than we can clock
+         * them out, so normally all responses are ready. */
+        for (i=0; i<33; i++)
+            queue_pe_response(a);
+        n = get_pe_responses(a, reply, 33, &nlost);
+        if (n < 33 && debug_level > 0)
+            fprintf(stderr, "%s: PE not ready, %u responses of 33\n",
+                a->name, n);
+        if (nlost > 0) {
+            /* Drain the rest, and read the block again on the slow path. */
+            for (n += nlost; n < 33; n++)
+                get_pe_response(a);
+            mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                        ETAP_COMMAND_NBITS, ETAP_FASTDATA,
+                        TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                        0);
+            xfer_fastdata(a, PE_READ << 16 | 32);
+            xfer_fastdata(a, addr);
+            n = 0;
+        }
+        while (n < 33)
+            reply[n++] = get_pe_response(a);
+
+        if (reply[0] != PE_READ << 16) {
             fprintf(stderr, "%s: bad READ response = %08x, expected %08x\n",
-                a->name, response, PE_READ << 16);
+                a->name, reply[0], PE_READ << 16);
             exit(-1);
         }
-        for (i=0; i<32; i++) {
-            *data++ = get_pe_response(a);           /* Get data */
-        }
+        memcpy(data, &reply[1], 32*4);
+        data += 32;
         addr += 32*4;
     }
 }
 
+/*
+ * Check whether the PE of given version is running.
+ * PrAcc is polled a few times only, as nobody answers
+ * when the target has been reset.
+ */
+static int mpsse_pe_running(mpsse_adapter_t *a, unsigned pe_version)
+{
+    unsigned version;
+
+    mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                    ETAP_COMMAND_NBITS, ETAP_FASTDATA,
+                    TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                    0);
+    xfer_fastdata(a, PE_EXEC_VERSION << 16);
+    if (! try_pe_response(a, 16, &version))
+        return 0;
+    return version == (PE_EXEC_VERSION << 16 | pe_version);
+}
+
+/*
+ * In auto mode, find the highest TCK rate, at which the PE
+ * answers EXEC_VERSION reliably, up to the limit found by IDCODE.
+ * The request can be safely repeated. Use one step lower,
+ * to have a safety margin.
+ */
+static void mpsse_tune_pe_speed(mpsse_adapter_t *a, unsigned pe_version)
+{
+    int i, k, best = 0;
+
+    a->pe_tuned = 1;
+    for (i=1; i <= a->tck_limit; i++) {
+        mpsse_speed(a, tck_rates[i]);
+        for (k=0; k<16; k++) {
+            if (! mpsse_pe_running(a, pe_version))
+                break;
+        }
+        if (k < 16)
+            break;
+        best = i;
+    }
+    if (best > 0)
+        best--;
+    mpsse_speed(a, tck_rates[best]);
+    if (! mpsse_pe_running(a, pe_version)) {
+        fprintf(stderr, "%s: no PE response at %d kHz\n", a->name, a->khz);
+        exit(-1);
+    }
+    if (debug_level > 0)
+        fprintf(stderr, "%s: auto TCK rate %d kHz, checked by PE\n",
+            a->name, a->khz);
+}
+
 /*
  * Download programming executive (PE).
  */
@@ -796,7 +1374,24 @@ static void mpsse_load_executive(adapter_t *adapter,
     const unsigned *pe, unsigned nwords, unsigned pe_version)
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    unsigned code [12 + PIC32_PE_LOADER_LEN*2], ninstr = 0;
 
+    /* The PE may still run since a previous download.
+     * Probe it first, as serial execution resets the CPU. */
+    if (! a->serial_execution_mode)
+        mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                        MTAP_COMMAND_NBITS, TAP_SW_ETAP,
+                        TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                        0);
+    if (mpsse_pe_running(a, pe_version)) {
+        if (debug_level > 0)
+            fprintf(stderr, "%s: PE already running\n", a->name);
+        a->use_executive = 1;
+        a->serial_execution_mode = 1;
+        if (a->auto_khz && ! a->pe_tuned)
+            mpsse_tune_pe_speed(a, pe_version);
+        return;
+    }
     a->use_executive = 1;
     serial_execution(a);
 
@@ -804,24 +1399,24 @@ static void mpsse_load_executive(adapter_t *adapter,
         fprintf(stderr, "%s: download PE loader\n", a->name);
 
     /* Step 1. */
-    xfer_instruction(a, 0x3c04bf88);    // lui a0, 0xbf88
-    xfer_instruction(a, 0x34842000);    // ori a0, 0x2000 - address of BMXCON
-    xfer_instruction(a, 0x3c05001f);    // lui a1, 0x1f
-    xfer_instruction(a, 0x34a50040);    // ori a1, 0x40   - a1 has 001f0040
-    xfer_instruction(a, 0xac850000);    // sw  a1, 0(a0)  - BMXCON initialized
+    code[ninstr++] = 0x3c04bf88;        // lui a0, 0xbf88
+    code[ninstr++] = 0x34842000;        // ori a0, 0x2000 - address of BMXCON
+    code[ninstr++] = 0x3c05001f;        // lui a1, 0x1f
+    code[ninstr++] = 0x34a50040;        // ori a1, 0x40   - a1 has 001f0040
+    code[ninstr++] = 0xac850000;        // sw  a1, 0(a0)  - BMXCON initialized
 
     /* Step 2. */
-    xfer_instruction(a, 0x34050800);    // li  a1, 0x800  - a1 has 00000800
-    xfer_instruction(a, 0xac850010);    // sw  a1, 16(a0) - BMXDKPBA initialized
+    code[ninstr++] = 0x34050800;        // li  a1, 0x800  - a1 has 00000800
+    code[ninstr++] = 0xac850010;        // sw  a1, 16(a0) - BMXDKPBA initialized
 
     /* Step 3. */
-    xfer_instruction(a, 0x8c850040);    // lw  a1, 64(a0) - load BMXDMSZ
-    xfer_instruction(a, 0xac850020);    // sw  a1, 32(a0) - BMXDUDBA initialized
-    xfer_instruction(a, 0xac850030);    // sw  a1, 48(a0) - BMXDUPBA initialized
+    code[ninstr++] = 0x8c850040;        // lw  a1, 64(a0) - load BMXDMSZ
+    code[ninstr++] = 0xac850020;        // sw  a1, 32(a0) - BMXDUDBA initialized
+    code[ninstr++] = 0xac850030;        // sw  a1, 48(a0) - BMXDUPBA initialized
 
     /* Step 4. */
-    xfer_instruction(a, 0x3c04a000);    // lui a0, 0xa000
-    xfer_instruction(a, 0x34840800);    // ori a0, 0x800  - a0 has a0000800
+    code[ninstr++] = 0x3c04a000;        // lui a0, 0xa000
+    code[ninstr++] = 0x34840800;        // ori a0, 0x800  - a0 has a0000800
 
     /* Download the PE loader. */
     int i;
@@ -830,12 +1425,15 @@ static void mpsse_load_executive(adapter_t *adapter,
         unsigned opcode1 = 0x3c060000 | pic32_pe_loader[i];
         unsigned opcode2 = 0x34c60000 | pic32_pe_loader[i+1];
 
-        xfer_instruction(a, opcode1);       // lui a2, PE_loader_hi++
-        xfer_instruction(a, opcode2);       // ori a2, PE_loader_lo++
-        xfer_instruction(a, 0xac860000);    // sw  a2, 0(a0)
-        xfer_instruction(a, 0x24840004);    // addiu a0, 4
+        code[ninstr++] = opcode1;       // lui a2, PE_loader_hi++
+        code[ninstr++] = opcode2;       // ori a2, PE_loader_lo++
+        code[ninstr++] = 0xac860000;    // sw  a2, 0(a0)
+        code[ninstr++] = 0x24840004;    // addiu a0, 4
     }
 
+    /* Steps 1-5 are restartable, as a0 is reloaded at step 4. */
+    xfer_instructions(a, code, ninstr);
+
     /* Jump to PE loader (step 6). */
     xfer_instruction(a, 0x3c19a000);    // lui t9, 0xa000
     xfer_instruction(a, 0x37390800);    // ori t9, 0x800  - t9 has a0000800
@@ -869,16 +1467,24 @@ static void mpsse_load_executive(adapter_t *adapter,
         xfer_fastdata(a, *pe++);
     }
     mpsse_flush_output(a);
+    wait_all_transfers(a);      /* The delay starts when data is sent. */
     mdelay(10);
 
     /* Download the PE instructions. */
     xfer_fastdata(a, 0);                        /* Step 8 - jump to PE. */
     xfer_fastdata(a, 0xDEAD0000);
     mpsse_flush_output(a);
+    wait_all_transfers(a);
     mdelay(10);
     xfer_fastdata(a, PE_EXEC_VERSION << 16);
 
     unsigned version = get_pe_response(a);
+    while (version != (PE_EXEC_VERSION << 16 | pe_version) &&
+           mpsse_slow_down(a)) {
+        /* Version request has no side effects: ask again at lower rate. */
+        if (mpsse_pe_running(a, pe_version))
+            version = PE_EXEC_VERSION << 16 | pe_version;
+    }
     if (version != (PE_EXEC_VERSION << 16 | pe_version)) {
         fprintf(stderr, "%s: bad PE version = %08x, expected %08x\n",
             a->name, version, PE_EXEC_VERSION << 16 | pe_version);
@@ -887,6 +1493,9 @@ static void mpsse_load_executive(adapter_t *adapter,
     if (debug_level > 0)
         fprintf(stderr, "%s: PE version = %04x\n",
             a->name, version & 0xffff);
+
+    if (a->auto_khz && ! a->pe_tuned)
+        mpsse_tune_pe_speed(a, pe_version);
 }
 
 /*
@@ -895,24 +1504,53 @@ static void mpsse_load_executive(adapter_t *adapter,
 static void mpsse_erase_chip(adapter_t *adapter)
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    unsigned status;
+    int i;
 
     /* Send command. */
     mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
-                    TMS_HEADER_COMMAND_VAL, TAP_SW_MTAP,
+                    MTAP_COMMAND_NBITS, TAP_SW_MTAP,
                     TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
                     0);
     /* Send command. */
     mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
-                    TMS_HEADER_COMMAND_VAL, MTAP_COMMAND,
+                    MTAP_COMMAND_NBITS, MTAP_COMMAND,
                     TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
                     0);
     /* Xfer data. */
     mpsse_send(a, TMS_HEADER_XFERDATA_NBITS, TMS_HEADER_XFERDATA_VAL,
-                    MTAP_COMMAND_DR_NBITS, MTAP_COMMAND,
+                    MTAP_COMMAND_DR_NBITS, MCHP_ERASE,
                     TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
                     0);
+    if (memcmp(a->adapter.family_name, "mz", 2) == 0) {
+        /* Needed for PIC32MZ devices only. */
+        mpsse_send(a, TMS_HEADER_XFERDATA_NBITS, TMS_HEADER_XFERDATA_VAL,
+                        MTAP_COMMAND_DR_NBITS, MCHP_DEASSERT_RST,
+                        TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
+                        0);
+    }
     mpsse_flush_output(a);
-    mdelay(400);
+    wait_all_transfers(a);
+
+    /* Poll the status until the flash controller is done. */
+    for (i=0; ; i++) {
+        mdelay(10);
+        mpsse_send(a, TMS_HEADER_XFERDATA_NBITS, TMS_HEADER_XFERDATA_VAL,
+                        MTAP_COMMAND_DR_NBITS, MCHP_STATUS,
+                        TMS_FOOTER_XFERDATA_NBITS, TMS_FOOTER_XFERDATA_VAL,
+                        1);
+        status = mpsse_recv(a);
+        if ((status & (MCHP_STATUS_CFGRDY | MCHP_STATUS_FCBUSY)) ==
+            MCHP_STATUS_CFGRDY)
+            break;
+        if (i >= 100) {
+            fprintf(stderr, "%s: invalid status = %04x (erase chip)\n",
+                a->name, status);
+            exit(-1);
+        }
+    }
+    if (debug_level > 0)
+        fprintf(stderr, "%s: chip erased in %d msec\n", a->name, (i + 1) * 10);
 
     /* Leave it in ETAP mode. */
     /* Send command. */
@@ -986,14 +1624,17 @@ static void mpsse_program_row(adapter_t *adapter, unsigned addr,
     mpsse_flush_output(a);
     xfer_fastdata(a, addr);                     /* Send address. */
 
-    /* Download data. */
+    /* Download data.
+     * Flush is not blocking, so the adapter starts clocking out
+     * the first words while the rest of the row is being queued. */
     for (i = 0; i < words_per_row; i++) {
-        if ((i & 7) == 0)
+        if ((i & 31) == 0)
             mpsse_flush_output(a);
         xfer_fastdata(a, *data++);              /* Send word. */
     }
     mpsse_flush_output(a);
 
+    /* Not repeated: the row may be partly written already. */
     unsigned response = get_pe_response(a);
     if (response != (PE_ROW_PROGRAM << 16)) {
         fprintf(stderr, "%s: failed to program row at %08x, reply = %08x\n",
@@ -1003,15 +1644,99 @@ static void mpsse_program_row(adapter_t *adapter, unsigned addr,
 }
 
 /*
- * Verify a block of memory.
+ * Program a number of whole rows of flash memory,
+ * with a single command and a single response.
  */
-static void mpsse_verify_data(adapter_t *adapter,
-    unsigned addr, unsigned nwords, unsigned *data)
+static void mpsse_program_cluster(adapter_t *adapter, unsigned addr,
+    unsigned *data, unsigned nwords, unsigned words_per_row)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    int i;
+
+    if (debug_level > 0)
+        fprintf(stderr, "%s: cluster program %u words at %08x\n",
+            a->name, nwords, addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow flash write not implemented yet.\n", a->name);
+        exit(-1);
+    }
+
+    /* Use PE to write flash memory. */
+    /* Send command. */
+    mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                    ETAP_COMMAND_NBITS, ETAP_FASTDATA,
+                    TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                    0);
+    xfer_fastdata(a, PE_PROGRAM_CLUSTER << 16);
+    mpsse_flush_output(a);
+    xfer_fastdata(a, addr);                     /* Send address. */
+    xfer_fastdata(a, nwords * 4);               /* Send length in bytes. */
+
+    /* Download data.
+     * The PE writes a row before it takes the next one, so the
+     * first word of every next row waits until the PE is ready. */
+    for (i = 0; i < nwords; i++) {
+        if (i > 0 && i % words_per_row == 0)
+            xfer_fastdata_sync(a, *data++);     /* Send word and wait. */
+        else {
+            if ((i & 31) == 0)
+                mpsse_flush_output(a);
+            xfer_fastdata(a, *data++);          /* Send word. */
+        }
+    }
+    mpsse_flush_output(a);
+
+    /* Not repeated: the rows may be partly written already. */
+    unsigned response = get_pe_response(a);
+    if (response != (PE_PROGRAM_CLUSTER << 16)) {
+        fprintf(stderr, "%s: failed to program cluster at %08x, reply = %08x\n",
+            a->name, addr, response);
+        exit(-1);
+    }
+}
+
+/*
+ * Erase a range of flash pages.
+ */
+static void mpsse_erase_page(adapter_t *adapter, unsigned addr, unsigned npages)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+
+    if (debug_level > 0)
+        fprintf(stderr, "%s: erase %u pages at %08x\n", a->name, npages, addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow page erase not implemented yet.\n", a->name);
+        exit(-1);
+    }
+
+    /* Use PE to erase flash memory. */
+    /* Send command. */
+    mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                    ETAP_COMMAND_NBITS, ETAP_FASTDATA,
+                    TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                    0);
+    xfer_fastdata(a, PE_PAGE_ERASE << 16 | npages);
+    mpsse_flush_output(a);
+    xfer_fastdata(a, addr);                     /* Send address. */
+
+    unsigned response = get_pe_response(a);
+    if (response != (PE_PAGE_ERASE << 16)) {
+        fprintf(stderr, "%s: failed to erase %u pages at %08x, reply = %08x\n",
+            a->name, npages, addr, response);
+        exit(-1);
+    }
+}
+
+/*
+ * Get CRC of a block of memory.
+ */
+static unsigned mpsse_get_crc(adapter_t *adapter,
+    unsigned addr, unsigned nbytes)
 {
     mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
-    unsigned data_crc, flash_crc;
 
-    //fprintf(stderr, "%s: verify %d words at %08x\n", a->name, nwords, addr);
     if (! a->use_executive) {
         /* Without PE. */
         fprintf(stderr, "%s: slow verify not implemented yet.\n", a->name);
@@ -1028,15 +1753,64 @@ static void mpsse_verify_data(adapter_t *adapter,
     mpsse_flush_output(a);
     xfer_fastdata(a, addr);                     /* Send address. */
     mpsse_flush_output(a);
-    xfer_fastdata(a, nwords * 4);               /* Send length. */
+    xfer_fastdata(a, nbytes);                   /* Send length. */
 
     unsigned response = get_pe_response(a);
     if (response != (PE_GET_CRC << 16)) {
-        fprintf(stderr, "%s: failed to verify %d words at %08x, reply = %08x\n",
-            a->name, nwords, addr, response);
+        fprintf(stderr, "%s: failed to get crc of %d bytes at %08x, reply = %08x\n",
+            a->name, nbytes, addr, response);
+        exit(-1);
+    }
+    return get_pe_response(a) & 0xffff;
+}
+
+/*
+ * Check that a block of memory is erased.
+ * Return 1 when all bytes are 0xFF.
+ */
+static int mpsse_blank_check(adapter_t *adapter,
+    unsigned addr, unsigned nbytes)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow blank check not implemented yet.\n", a->name);
+        exit(-1);
+    }
+
+    /* Use PE to check flash memory. */
+    /* Send command. */
+    mpsse_send(a, TMS_HEADER_COMMAND_NBITS, TMS_HEADER_COMMAND_VAL,
+                    ETAP_COMMAND_NBITS, ETAP_FASTDATA,
+                    TMS_FOOTER_COMMAND_NBITS, TMS_FOOTER_COMMAND_VAL,
+                    0);
+    xfer_fastdata(a, PE_BLANK_CHECK << 16);
+    mpsse_flush_output(a);
+    xfer_fastdata(a, addr);                     /* Send address. */
+    mpsse_flush_output(a);
+    xfer_fastdata(a, nbytes);                   /* Send length. */
+
+    unsigned response = get_pe_response(a);
+    if ((response >> 16) != PE_BLANK_CHECK) {
+        fprintf(stderr, "%s: failed to check %d bytes at %08x, reply = %08x\n",
+            a->name, nbytes, addr, response);
         exit(-1);
     }
-    flash_crc = get_pe_response(a) & 0xffff;
+    return (response & 0xffff) == 0;            /* response code 0 = blank */
+}
+
+/*
+ * Verify a block of memory.
+ */
+static void mpsse_verify_data(adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
+{
+    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    unsigned data_crc, flash_crc;
+
+    //fprintf(stderr, "%s: verify %d words at %08x\n", a->name, nwords, addr);
+    flash_crc = mpsse_get_crc(adapter, addr, nwords * 4);
 
     data_crc = calculate_crc(0xffff, (unsigned char*) data, nwords * 4);
     if (flash_crc != data_crc) {
@@ -1129,6 +1903,12 @@ found:
 
     libusb_claim_interface(a->usbdev, 0);
 
+    /* Size of USB packet for receive endpoint:
+     * 64 bytes for full speed, 512 bytes for high speed adapters. */
+    a->max_packet_size = libusb_get_max_packet_size(libusb_get_device(a->usbdev), OUT_EP);
+    if (a->max_packet_size <= 2 || a->max_packet_size > 512)
+        a->max_packet_size = 64;
+
     /* Reset the ftdi device. */
     if (libusb_control_transfer(a->usbdev,
         LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
@@ -1137,7 +1917,8 @@ found:
             fprintf(stderr, "%s: superuser privileges needed.\n", a->name);
         else
             fprintf(stderr, "%s: FTDI reset failed\n", a->name);
-failed: libusb_release_interface(a->usbdev, 0);
+failed: free_transfers(a);
+        libusb_release_interface(a->usbdev, 0);
         libusb_close(a->usbdev);
         free(a);
         return 0;
@@ -1168,8 +1949,11 @@ failed: libusb_release_interface(a->usbdev, 0);
     if (debug_level)
         fprintf(stderr, "%s: latency timer: %u usec\n", a->name, latency_timer);
 
+    /* Prepare a ring of asynchronous transfers. */
+    alloc_transfers(a);
+
     /* By default, use 500 kHz speed. */
-    int khz = 500;
+    int khz = (jtag_khz > 0) ? jtag_khz : 500;
     mpsse_speed(a, khz);
 
     /* Disable TDI to TDO loopback. */
@@ -1197,6 +1981,10 @@ failed: libusb_release_interface(a->usbdev, 0);
         mpsse_reset(a, 0, 0, 0);
         goto failed;
     }
+    if (jtag_khz < 0) {
+        mpsse_tune_speed(a, idcode);
+        a->auto_khz = 1;
+    }
 
     /* Activate /SYSRST and LED. */
     mpsse_reset(a, 0, 1, 1);
@@ -1233,6 +2021,12 @@ failed: libusb_release_interface(a->usbdev, 0);
         goto failed;
     }
     printf("      Adapter: %s\n", a->name);
+    if (jtag_khz != 0)
+        printf("   JTAG clock: %d kHz%s\n", a->khz, a->auto_khz ? " (auto)" : "");
+
+    /* Send instruction sequences without polling PrAcc,
+     * until the CPU happens to be not ready. */
+    a->assume_ready = 1;
 
     a->adapter.block_override = 0;
     a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
@@ -1245,7 +2039,11 @@ failed: libusb_release_interface(a->usbdev, 0);
     a->adapter.read_data = mpsse_read_data;
     a->adapter.verify_data = mpsse_verify_data;
     a->adapter.erase_chip = mpsse_erase_chip;
+    a->adapter.erase_page = mpsse_erase_page;
+    a->adapter.get_crc = mpsse_get_crc;
+    a->adapter.blank_check = mpsse_blank_check;
     a->adapter.program_word = mpsse_program_word;
     a->adapter.program_row = mpsse_program_row;
+    a->adapter.program_cluster = mpsse_program_cluster;
     return &a->adapter;
 }
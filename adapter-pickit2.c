@@ -21,6 +21,7 @@
 #include "hidapi.h"
 #include "pickit2.h"
 #include "pic32.h"
+#include "stats.h"
 
 typedef struct {
     /* Common part */
@@ -35,6 +36,11 @@ typedef struct {
     unsigned use_executive;
     unsigned serial_execution_mode;
 
+    /* PE response of the last row write, not read yet. */
+    int write_pending;
+    unsigned write_addr;
+    const char *write_what;
+
 } pickit_adapter_t;
 
 /*
@@ -80,7 +86,9 @@ static void pickit_send_buf(pickit_adapter_t *a, unsigned char *buf, unsigned nb
         }
         fprintf(stderr, "\n");
     }
+    unsigned long long t0 = stats_time();
     hid_write(a->hiddev, buf, 64);
+    stats_event(STAT_USB_OUT, 64, t0);
 }
 
 static void pickit_send(pickit_adapter_t *a, unsigned argc, ...)
@@ -97,9 +105,13 @@ static void pickit_send(pickit_adapter_t *a, unsigned argc, ...)
     pickit_send_buf(a, buf, i);
 }
 
-static void pickit_recv(pickit_adapter_t *a)
+static void pickit_read_report(pickit_adapter_t *a)
 {
-    if (hid_read(a->hiddev, a->reply, 64) != 64) {
+    unsigned long long t0 = stats_time();
+    int n = hid_read(a->hiddev, a->reply, 64);
+
+    stats_event(STAT_USB_IN, n > 0 ? n : 0, t0);
+    if (n != 64) {
         fprintf(stderr, "%s: error receiving packet\n", a->name);
         exit(-1);
     }
@@ -115,6 +127,51 @@ static void pickit_recv(pickit_adapter_t *a)
     }
 }
 
+/*
+ * Get the PE response of the last flash write, and check it.
+ * The response is left in the input queue of the adapter,
+ * so that the next row can be downloaded without waiting.
+ */
+static void check_write_response(pickit_adapter_t *a)
+{
+    if (! a->write_pending)
+        return;
+    a->write_pending = 0;
+
+    pickit_read_report(a);
+    //fprintf(stderr, "%s: program PE response %u bytes: %02x...\n",
+    //  a->name, a->reply[0], a->reply[1]);
+    if (a->reply[0] != 4 || a->reply[1] != 0) { // response code 0 = success
+        fprintf(stderr, "%s: failed to program %s at %08x, reply = %02x-%02x-%02x-%02x-%02x\n",
+            a->name, a->write_what, a->write_addr,
+            a->reply[0], a->reply[1], a->reply[2], a->reply[3], a->reply[4]);
+        exit(-1);
+    }
+}
+
+static void pickit_recv(pickit_adapter_t *a)
+{
+    check_write_response(a);
+    pickit_read_report(a);
+}
+
+/*
+ * Request the PE response of a flash write, but don't wait for it.
+ */
+static void request_write_response(pickit_adapter_t *a,
+    unsigned addr, const char *what)
+{
+    pickit_send(a, 5, CMD_CLEAR_UPLOAD_BUFFER,
+        CMD_EXECUTE_SCRIPT, 1,
+            SCRIPT_JT2_GET_PE_RESP,
+        CMD_UPLOAD_DATA);
+
+    check_write_response(a);
+    a->write_pending = 1;
+    a->write_addr = addr;
+    a->write_what = what;
+}
+
 static void check_timeout(pickit_adapter_t *a, const char *message)
 {
     unsigned status;
@@ -393,11 +450,21 @@ static void pickit_load_executive(adapter_t *adapter,
         fprintf(stderr, "%s: PE version = %04x\n", a->name, version);
 }
 
-#if 0
-int pe_blank_check(pickit_adapter_t *a,
-    unsigned int start, unsigned int nbytes)
+/*
+ * Check that a block of memory is erased.
+ * Return 1 when all bytes are 0xFF.
+ */
+static int pickit_blank_check(adapter_t *adapter,
+    unsigned start, unsigned nbytes)
 {
-    pickit_send(a, 21, CMD_CLEAR_UPLOAD_BUFFER, CMD_EXECUTE_SCRIPT, 18,
+    pickit_adapter_t *a = (pickit_adapter_t*) adapter;
+
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow blank check not implemented yet.\n", a->name);
+        exit(-1);
+    }
+    pickit_send(a, 23, CMD_CLEAR_UPLOAD_BUFFER, CMD_EXECUTE_SCRIPT, 20,
         SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
         SCRIPT_JT2_XFRFASTDAT_LIT,
             0x00, 0x00,
@@ -412,19 +479,32 @@ int pe_blank_check(pickit_adapter_t *a,
             (unsigned char) (nbytes >> 8),
             (unsigned char) (nbytes >> 16),
             (unsigned char) (nbytes >> 24),
+        SCRIPT_JT2_WAIT_PE_RESP,
         SCRIPT_JT2_GET_PE_RESP);
     check_timeout(a, "BLANK_CHECK");
     pickit_send(a, 1, CMD_UPLOAD_DATA);
     pickit_recv(a);
-    if (a->reply[3] != 6 || a->reply[1] != 0) { // response code 0 = success
-        return 0;
+    if (a->reply[0] != 4 || a->reply[3] != 6) {
+        fprintf(stderr, "%s: failed to check %u bytes at %08x, reply = %02x-%02x-%02x-%02x-%02x\n",
+            a->name, nbytes, start, a->reply[0], a->reply[1], a->reply[2], a->reply[3], a->reply[4]);
+        exit(-1);
     }
-    return 1;
+    return a->reply[1] == 0;                    // response code 0 = blank
 }
 
-int pe_get_crc(pickit_adapter_t *a,
-    unsigned int start, unsigned int nbytes)
+/*
+ * Get CRC of a block of memory.
+ */
+static unsigned pickit_get_crc(adapter_t *adapter,
+    unsigned start, unsigned nbytes)
 {
+    pickit_adapter_t *a = (pickit_adapter_t*) adapter;
+
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow verify not implemented yet.\n", a->name);
+        exit(-1);
+    }
     pickit_send(a, 22, CMD_CLEAR_UPLOAD_BUFFER, CMD_EXECUTE_SCRIPT, 19,
         SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
         SCRIPT_JT2_XFRFASTDAT_LIT,
@@ -446,16 +526,17 @@ int pe_get_crc(pickit_adapter_t *a,
     pickit_send(a, 1, CMD_UPLOAD_DATA);
     pickit_recv(a);
     if (a->reply[3] != 8 || a->reply[1] != 0) { // response code 0 = success
-        return 0;
+        fprintf(stderr, "%s: failed to get crc of %u bytes at %08x, reply = %02x-%02x-%02x-%02x-%02x\n",
+            a->name, nbytes, start, a->reply[0], a->reply[1], a->reply[2], a->reply[3], a->reply[4]);
+        exit(-1);
     }
-
-    int crc = a->reply[5] | (a->reply[6] << 8);
-    return crc;
+    return a->reply[5] | (a->reply[6] << 8);
 }
-#endif
 
 static void pickit_finish(pickit_adapter_t *a, int power_on)
 {
+    check_write_response(a);
+
     /* Exit programming mode. */
     pickit_send(a, 18, CMD_CLEAR_UPLOAD_BUFFER, CMD_EXECUTE_SCRIPT, 15,
         SCRIPT_JT2_SETMODE, 5, 0x1f,
@@ -595,6 +676,31 @@ static unsigned pickit_read_word(adapter_t *adapter, unsigned addr)
     return value;
 }
 
+/*
+ * Add to the buffer a script run, which reads 32 words
+ * of memory, and a request for the first half of upload buffer.
+ * The address is taken from download buffer.
+ * Return the new length of the buffer.
+ */
+static unsigned append_read_script(unsigned char *buf, unsigned k)
+{
+    static const unsigned char script[] = {
+        CMD_CLEAR_UPLOAD_BUFFER,
+        CMD_EXECUTE_SCRIPT, 13,
+            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                0x20, 0, 1, 0,                  // READ
+            SCRIPT_JT2_XFRFASTDAT_BUF,
+            SCRIPT_JT2_WAIT_PE_RESP,
+            SCRIPT_JT2_GET_PE_RESP,
+            SCRIPT_LOOP, 1, 31,
+        CMD_UPLOAD_DATA_NOLEN,
+    };
+
+    memcpy(buf + k, script, sizeof(script));
+    return k + sizeof(script);
+}
+
 /*
  * Read a block of memory, multiple of 1 kbyte.
  */
@@ -615,7 +721,11 @@ static void pickit_read_data(adapter_t *adapter,
         return;
     }
 
-    /* Use PE to read memory. */
+    /* Use PE to read memory.
+     * Every script run reads 32 words into the upload buffer,
+     * which is collected in two reports. The request for the second
+     * half is packed together with the next script run, so the
+     * adapter starts reading next words while the host gets data. */
     for (words_read = 0; words_read < nwords; ) {
         /* Download addresses for 8 script runs. */
         unsigned i, k = 0;
@@ -630,28 +740,24 @@ static void pickit_read_data(adapter_t *adapter,
             buf[k++] = address >> 16;
             buf[k++] = address >> 24;
         }
+        k = append_read_script(buf, k);
         pickit_send_buf(a, buf, k);
 
-        for (k = 0; k < 8; k++) {
-            /* Read progmem. */
-            pickit_send(a, 17, CMD_CLEAR_UPLOAD_BUFFER,
-                CMD_EXECUTE_SCRIPT, 13,
-                    SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
-                    SCRIPT_JT2_XFRFASTDAT_LIT,
-                        0x20, 0, 1, 0,          // READ
-                    SCRIPT_JT2_XFRFASTDAT_BUF,
-                    SCRIPT_JT2_WAIT_PE_RESP,
-                    SCRIPT_JT2_GET_PE_RESP,
-                    SCRIPT_LOOP, 1, 31,
-                CMD_UPLOAD_DATA_NOLEN);
+        for (i = 0; i < 8; i++) {
+            /* Get first half of upload buffer. */
             pickit_recv(a);
             memcpy(data, a->reply, 64);
 //fprintf(stderr, "   ...%08x...\n", data[0]);
             data += 64/4;
             words_read += 64/4;
 
-            /* Get second half of upload buffer. */
-            pickit_send(a, 1, CMD_UPLOAD_DATA_NOLEN);
+            /* Get second half, and start next script run. */
+            memset(buf, CMD_END_OF_BUFFER, 64);
+            k = 0;
+            buf[k++] = CMD_UPLOAD_DATA_NOLEN;
+            if (i < 7)
+                k = append_read_script(buf, k);
+            pickit_send_buf(a, buf, k);
             pickit_recv(a);
             memcpy(data, a->reply, 64);
             data += 64/4;
@@ -837,36 +943,13 @@ static void pickit_program_quad_word(adapter_t *adapter, unsigned addr,
 }
 
 /*
- * Flash write row of memory.
+ * Send one row of data to the PE, using fastdata transfers.
  */
-static void pickit_program_row(adapter_t *adapter, unsigned addr,
-    unsigned *data, unsigned words_per_row)
+static void download_row(pickit_adapter_t *a, unsigned *data,
+    unsigned words_per_row)
 {
-    pickit_adapter_t *a = (pickit_adapter_t*) adapter;
     unsigned i;
 
-    if (debug_level > 0)
-        fprintf(stderr, "%s: row program %u words at %08x\n",
-            a->name, words_per_row, addr);
-    if (! a->use_executive) {
-        /* Without PE. */
-        fprintf(stderr, "%s: slow flash write not implemented yet.\n", a->name);
-        exit(-1);
-    }
-    /* Use PE to write flash memory. */
-
-    pickit_send(a, 15, CMD_CLEAR_UPLOAD_BUFFER,
-        CMD_EXECUTE_SCRIPT, 12,
-            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
-            SCRIPT_JT2_XFRFASTDAT_LIT,
-                words_per_row, 0, 0, 0,         // PROGRAM ROW
-            SCRIPT_JT2_XFRFASTDAT_LIT,
-                (unsigned char) addr,
-                (unsigned char) (addr >> 8),
-                (unsigned char) (addr >> 16),
-                (unsigned char) (addr >> 24));
-
-    /* Download data. */
     if (words_per_row == 32) {
         /* MX1/2 family. */
         download_data(a, data, 15, 1);
@@ -903,20 +986,90 @@ static void pickit_program_row(adapter_t *adapter, unsigned addr,
             data += 64;
         }
     }
+}
 
-    pickit_send(a, 5, CMD_CLEAR_UPLOAD_BUFFER,
-        CMD_EXECUTE_SCRIPT, 1,
-            SCRIPT_JT2_GET_PE_RESP,
-        CMD_UPLOAD_DATA);
+/*
+ * Flash write row of memory.
+ */
+static void pickit_program_row(adapter_t *adapter, unsigned addr,
+    unsigned *data, unsigned words_per_row)
+{
+    pickit_adapter_t *a = (pickit_adapter_t*) adapter;
 
-    pickit_recv(a);
-    //fprintf(stderr, "%s: program PE response %u bytes: %02x...\n",
-    //  a->name, a->reply[0], a->reply[1]);
-    if (a->reply[0] != 4 || a->reply[1] != 0) { // response code 0 = success
-        fprintf(stderr, "%s: failed to program row flash memory at %08x, reply = %02x-%02x-%02x-%02x-%02x\n",
-            a->name, addr, a->reply[0], a->reply[1], a->reply[2], a->reply[3], a->reply[4]);
+    if (debug_level > 0)
+        fprintf(stderr, "%s: row program %u words at %08x\n",
+            a->name, words_per_row, addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow flash write not implemented yet.\n", a->name);
         exit(-1);
     }
+    /* Use PE to write flash memory. */
+
+    pickit_send(a, 15, CMD_CLEAR_UPLOAD_BUFFER,
+        CMD_EXECUTE_SCRIPT, 12,
+            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                words_per_row, 0, 0, 0,         // PROGRAM ROW
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                (unsigned char) addr,
+                (unsigned char) (addr >> 8),
+                (unsigned char) (addr >> 16),
+                (unsigned char) (addr >> 24));
+
+    /* Download data. */
+    download_row(a, data, words_per_row);
+
+    /* The response is checked later. */
+    request_write_response(a, addr, "row flash memory");
+}
+
+/*
+ * Program a number of whole rows of flash memory,
+ * with a single command and a single response.
+ */
+static void pickit_program_cluster(adapter_t *adapter, unsigned addr,
+    unsigned *data, unsigned nwords, unsigned words_per_row)
+{
+    pickit_adapter_t *a = (pickit_adapter_t*) adapter;
+    unsigned nbytes = nwords * 4;
+    unsigned chunk = (words_per_row % 64 == 0) ? 64 : 32;
+
+    if (debug_level > 0)
+        fprintf(stderr, "%s: cluster program %u words at %08x\n",
+            a->name, nwords, addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow flash write not implemented yet.\n", a->name);
+        exit(-1);
+    }
+    /* Use PE to write flash memory. */
+
+    pickit_send(a, 20, CMD_CLEAR_UPLOAD_BUFFER,
+        CMD_EXECUTE_SCRIPT, 17,
+            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                0, 0, PE_PROGRAM_CLUSTER, 0,    // PROGRAM CLUSTER
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                (unsigned char) addr,
+                (unsigned char) (addr >> 8),
+                (unsigned char) (addr >> 16),
+                (unsigned char) (addr >> 24),
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                (unsigned char) nbytes,
+                (unsigned char) (nbytes >> 8),
+                (unsigned char) (nbytes >> 16),
+                (unsigned char) (nbytes >> 24));
+
+    /* Download data, in pieces of 32 or 64 words.
+     * The adapter waits for PrAcc on every FASTDATA transfer. */
+    for (; nwords > 0; nwords -= chunk) {
+        download_row(a, data, chunk);
+        data += chunk;
+    }
+
+    /* The response is checked later. */
+    request_write_response(a, addr, "cluster");
 }
 
 /*
@@ -935,6 +1088,44 @@ static void pickit_erase_chip(adapter_t *adapter)
     check_timeout(a, "chip erase");
 }
 
+/*
+ * Erase a range of flash pages.
+ */
+static void pickit_erase_page(adapter_t *adapter, unsigned addr, unsigned npages)
+{
+    pickit_adapter_t *a = (pickit_adapter_t*) adapter;
+
+    if (debug_level > 0)
+        fprintf(stderr, "%s: erase %u pages at %08x\n", a->name, npages, addr);
+    if (! a->use_executive) {
+        /* Without PE. */
+        fprintf(stderr, "%s: slow page erase not implemented yet.\n", a->name);
+        exit(-1);
+    }
+    /* Use PE to erase flash memory. */
+    pickit_send(a, 18, CMD_CLEAR_UPLOAD_BUFFER,
+        CMD_EXECUTE_SCRIPT, 14,
+            SCRIPT_JT2_SENDCMD, ETAP_FASTDATA,
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                (unsigned char) npages,
+                (unsigned char) (npages >> 8),
+                PE_PAGE_ERASE, 0,               // PAGE_ERASE
+            SCRIPT_JT2_XFRFASTDAT_LIT,
+                (unsigned char) addr,
+                (unsigned char) (addr >> 8),
+                (unsigned char) (addr >> 16),
+                (unsigned char) (addr >> 24),
+            SCRIPT_JT2_WAIT_PE_RESP,
+            SCRIPT_JT2_GET_PE_RESP,
+        CMD_UPLOAD_DATA);
+    pickit_recv(a);
+    if (a->reply[0] != 4 || a->reply[1] != 0) { // response code 0 = success
+        fprintf(stderr, "%s: failed to erase %u pages at %08x, reply = %02x-%02x-%02x-%02x-%02x\n",
+            a->name, npages, addr, a->reply[0], a->reply[1], a->reply[2], a->reply[3], a->reply[4]);
+        exit(-1);
+    }
+}
+
 /*
  * Initialize adapter PICkit2/PICkit3.
  * Return a pointer to a data structure, allocated dynamically.
@@ -1120,9 +1311,13 @@ static adapter_t *open_pickit(hid_device *hiddev, int is_pk3)
     a->adapter.read_word = pickit_read_word;
     a->adapter.read_data = pickit_read_data;
     a->adapter.erase_chip = pickit_erase_chip;
+    a->adapter.erase_page = pickit_erase_page;
+    a->adapter.get_crc = pickit_get_crc;
+    a->adapter.blank_check = pickit_blank_check;
     a->adapter.program_word = pickit_program_word;
     a->adapter.program_double_word = pickit_program_double_word;
     a->adapter.program_row = pickit_program_row;
+    a->adapter.program_cluster = pickit_program_cluster;
     a->adapter.program_quad_word = pickit_program_quad_word;
     return &a->adapter;
 }
@@ -0,0 +1,495 @@
+/*
+ * Simulated target: PIC32 flash memory model behind a virtual link.
+ *
+ * Every operation is charged with the transfer time over the link
+ * and the flash programming time, so the throughput of the host side
+ * can be measured without hardware.
+ *
+ * Port name is "sim:chip,key=value,...", for example:
+ *      sim:mx3
+ *      sim:mz,usb=1000,bw=500000,row=3000
+ *
+ * Parameters:
+ *      mx1, mx3, mz    - chip family, default mx3
+ *      usb=N           - latency of one transaction, usec
+ *      bw=N            - link bandwidth, bytes per second
+ *      word=N          - word program time, usec
+ *      row=N           - row program time, usec
+ *      page=N          - page erase time, usec
+ *      chip=N          - chip erase time, usec
+ *      crc=N           - CRC or blank check time per kbyte, usec
+ *      cluster=0       - old PE without PROGRAM_CLUSTER command
+ *      fill=N          - fill first N kbytes of flash with random data
+ *      realtime=1      - really wait for the simulated time
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "adapter.h"
+#include "pic32.h"
+#include "crc.h"
+#include "stats.h"
+
+#define FLASH_BASE      0x1d000000
+#define BOOT_BASE       0x1fc00000
+#define BOOT_BYTES      (80 * 1024)
+
+/*
+ * Simulated chips: one per family.
+ */
+static const struct {
+    const char  *name;
+    unsigned    devid;
+    unsigned    flash_kbytes;
+    unsigned    row_bytes;
+    unsigned    page_bytes;
+} sim_chips[] = {
+    { "mx1",    0x4D00053,   128,   128,    1024  },  /* MX250F128B */
+    { "mx3",    0x4307053,   512,   512,    4096  },  /* MX795F512L */
+    { "mz",     0x5127053,   2048,  2048,   16384 },  /* MZ2048ECH144 */
+    { 0 }
+};
+
+/*
+ * Operations, accounted separately.
+ */
+enum {
+    OP_PE_LOAD, OP_READ, OP_PROGRAM_ROW, OP_PROGRAM_CLUSTER,
+    OP_PROGRAM_WORD, OP_ERASE_CHIP, OP_ERASE_PAGE, OP_GET_CRC,
+    OP_BLANK_CHECK, NOPS
+};
+
+static const char *op_name [NOPS] = {
+    "pe-load", "read", "program-row", "program-cluster",
+    "program-word", "erase-chip", "erase-page", "get-crc",
+    "blank-check",
+};
+
+typedef struct {
+    /* Common part */
+    adapter_t adapter;
+
+    unsigned devid;
+    unsigned row_bytes;
+    unsigned page_bytes;
+    unsigned flash_bytes;
+    unsigned char *flash;
+    unsigned char boot [BOOT_BYTES];
+
+    /* Timing model, in microseconds. */
+    unsigned usb_usec;
+    unsigned bandwidth;
+    unsigned word_usec;
+    unsigned row_usec;
+    unsigned page_usec;
+    unsigned chip_usec;
+    unsigned crc_usec;
+    int realtime;
+    int pe_running;                     /* Executive is loaded */
+
+    /* Accounting. */
+    int op;                             /* Current operation */
+    unsigned long long usec;            /* Simulated time */
+    unsigned long long pending_usec;    /* Not yet waited, in realtime mode */
+    unsigned overwritten;               /* Words programmed over non-blank */
+    struct {
+        unsigned            count;
+        unsigned long long  nbytes;
+        unsigned long long  usec;
+    } stat [NOPS];
+} sim_adapter_t;
+
+/*
+ * Spend the simulated time.
+ */
+static void sim_delay(sim_adapter_t *a, unsigned long long usec)
+{
+    a->usec += usec;
+    a->stat[a->op].usec += usec;
+    if (a->realtime) {
+        a->pending_usec += usec;
+        if (a->pending_usec >= 1000) {
+            mdelay(a->pending_usec / 1000);
+            a->pending_usec %= 1000;
+        }
+    }
+}
+
+/*
+ * Start an operation: one request to the adapter and one reply.
+ */
+static void sim_xfer(sim_adapter_t *a, int op,
+    unsigned nbytes_out, unsigned nbytes_in, unsigned payload)
+{
+    a->op = op;
+    a->stat[op].count++;
+    a->stat[op].nbytes += payload;
+    stats_event(STAT_USB_OUT, nbytes_out, 0);
+    stats_event(STAT_USB_IN, nbytes_in, 0);
+    sim_delay(a, a->usb_usec +
+        (nbytes_out + nbytes_in) * 1000000ULL / a->bandwidth);
+}
+
+/*
+ * Get a pointer to the simulated memory.
+ * Both physical and virtual addresses are accepted.
+ */
+static unsigned char *sim_mem(sim_adapter_t *a, unsigned addr, unsigned nbytes)
+{
+    addr &= 0x1fffffff;
+    if (addr >= FLASH_BASE && addr + nbytes <= FLASH_BASE + a->flash_bytes)
+        return a->flash + addr - FLASH_BASE;
+    if (addr >= BOOT_BASE && addr + nbytes <= BOOT_BASE + BOOT_BYTES)
+        return a->boot + addr - BOOT_BASE;
+    fprintf(stderr, "sim: bad address %08x, %u bytes\n", addr, nbytes);
+    exit(-1);
+}
+
+/*
+ * Program flash: bits can only be cleared.
+ */
+static void sim_program(sim_adapter_t *a, unsigned addr,
+    const unsigned *data, unsigned nwords)
+{
+    unsigned *mem = (unsigned*) sim_mem(a, addr, nwords * 4);
+    unsigned i;
+
+    for (i=0; i<nwords; i++) {
+        if ((mem[i] & data[i]) != data[i]) {
+            if (debug_level > 0)
+                fprintf(stderr, "sim: overwrite at %08x: %08x -> %08x\n",
+                    addr + i*4, mem[i], data[i]);
+            a->overwritten++;
+        }
+        mem[i] &= data[i];
+    }
+}
+
+static void sim_close(adapter_t *adapter, int power_on)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned long long nbytes = 0;
+    int i;
+
+    printf("Simulation:\n");
+    printf("    Operation       Count        Bytes   Time, msec\n");
+    for (i=0; i<NOPS; i++) {
+        if (a->stat[i].count == 0)
+            continue;
+        printf("    %-15s %6u %12llu %12.1f\n", op_name[i],
+            a->stat[i].count, a->stat[i].nbytes, a->stat[i].usec / 1000.0);
+        if (i == OP_READ || i == OP_PROGRAM_ROW ||
+            i == OP_PROGRAM_CLUSTER || i == OP_PROGRAM_WORD)
+            nbytes += a->stat[i].nbytes;
+    }
+    if (a->usec > 0)
+        printf("    Simulated time %.1f msec, %.0f bytes per second\n",
+            a->usec / 1000.0, nbytes * 1000000.0 / a->usec);
+    if (a->overwritten)
+        printf("    Warning: %u words programmed over non-blank data\n",
+            a->overwritten);
+    free(a->flash);
+    free(a);
+}
+
+static unsigned sim_get_idcode(adapter_t *adapter)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    return a->devid;
+}
+
+/*
+ * PE is downloaded word by word through PrAcc:
+ * about 16 bytes of JTAG traffic per word, 32 words per transaction.
+ * When already running, only the version is requested.
+ */
+static void sim_load_executive(adapter_t *adapter,
+    const unsigned *pe, unsigned nwords, unsigned pe_version)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned i;
+
+    if (a->pe_running) {
+        sim_xfer(a, OP_PE_LOAD, 8, 4, 0);
+        return;
+    }
+    for (i=0; i<nwords; i+=32)
+        sim_xfer(a, OP_PE_LOAD, 32 * 16, 4, 32 * 4);
+    a->pe_running = 1;
+    if (debug_level > 0)
+        fprintf(stderr, "sim: PE version = %04x\n", pe_version);
+}
+
+static void sim_read_data(adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_xfer(a, OP_READ, 8, nwords * 4, nwords * 4);
+    memcpy(data, sim_mem(a, addr, nwords * 4), nwords * 4);
+}
+
+static unsigned sim_read_word(adapter_t *adapter, unsigned addr)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned word;
+
+    sim_xfer(a, OP_READ, 8, 4, 4);
+    memcpy(&word, sim_mem(a, addr, 4), 4);
+    return word;
+}
+
+static void sim_verify_data(adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned *mem = (unsigned*) sim_mem(a, addr, nwords * 4);
+    unsigned i;
+
+    sim_xfer(a, OP_GET_CRC, 12, 4, nwords * 4);
+    sim_delay(a, nwords * 4ULL * a->crc_usec / 1024);
+    for (i=0; i<nwords; i++) {
+        if (mem[i] != data[i]) {
+            printf("\nerror at address %08X: file=%08X, mem=%08X\n",
+                addr + i*4, data[i], mem[i]);
+            exit(1);
+        }
+    }
+}
+
+static void sim_program_word(adapter_t *adapter,
+    unsigned addr, unsigned word)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_xfer(a, OP_PROGRAM_WORD, 12, 4, 4);
+    sim_delay(a, a->word_usec);
+    sim_program(a, addr, &word, 1);
+}
+
+static void sim_program_double_word(adapter_t *adapter,
+    unsigned addr, unsigned word0, unsigned word1)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned data [2] = { word0, word1 };
+
+    sim_xfer(a, OP_PROGRAM_WORD, 16, 4, 8);
+    sim_delay(a, a->word_usec);
+    sim_program(a, addr, data, 2);
+}
+
+static void sim_program_quad_word(adapter_t *adapter, unsigned addr,
+    unsigned word0, unsigned word1, unsigned word2, unsigned word3)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned data [4] = { word0, word1, word2, word3 };
+
+    sim_xfer(a, OP_PROGRAM_WORD, 24, 4, 16);
+    sim_delay(a, a->word_usec);
+    sim_program(a, addr, data, 4);
+}
+
+static void sim_program_row(adapter_t *adapter, unsigned addr,
+    unsigned *data, unsigned words_per_row)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_xfer(a, OP_PROGRAM_ROW, 8 + words_per_row * 4, 4, words_per_row * 4);
+    sim_delay(a, a->row_usec);
+    sim_program(a, addr, data, words_per_row);
+}
+
+static void sim_program_cluster(adapter_t *adapter, unsigned addr,
+    unsigned *data, unsigned nwords, unsigned words_per_row)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned nrows = (nwords * 4 + a->row_bytes - 1) / a->row_bytes;
+
+    sim_xfer(a, OP_PROGRAM_CLUSTER, 12 + nwords * 4, 4, nwords * 4);
+    sim_delay(a, (unsigned long long) nrows * a->row_usec);
+    sim_program(a, addr, data, nwords);
+}
+
+static void sim_erase_chip(adapter_t *adapter)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_xfer(a, OP_ERASE_CHIP, 4, 4, 0);
+    sim_delay(a, a->chip_usec);
+
+    /* Chip erase resets the target. */
+    a->pe_running = 0;
+    memset(a->flash, 0xff, a->flash_bytes);
+    memset(a->boot, 0xff, BOOT_BYTES);
+}
+
+static void sim_erase_page(adapter_t *adapter, unsigned addr, unsigned npages)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+    unsigned nbytes = npages * a->page_bytes;
+
+    sim_xfer(a, OP_ERASE_PAGE, 8, 4, 0);
+    sim_delay(a, (unsigned long long) npages * a->page_usec);
+    memset(sim_mem(a, addr, nbytes), 0xff, nbytes);
+}
+
+static unsigned sim_get_crc(adapter_t *adapter, unsigned addr, unsigned nbytes)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_xfer(a, OP_GET_CRC, 12, 8, nbytes);
+    sim_delay(a, (unsigned long long) nbytes * a->crc_usec / 1024);
+    return calculate_crc(0xffff, sim_mem(a, addr, nbytes), nbytes);
+}
+
+static int sim_blank_check(adapter_t *adapter, unsigned addr, unsigned nbytes)
+{
+    sim_adapter_t *a = (sim_adapter_t*) adapter;
+
+    sim_xfer(a, OP_BLANK_CHECK, 12, 4, nbytes);
+    sim_delay(a, (unsigned long long) nbytes * a->crc_usec / 1024);
+    return adapter_is_blank(sim_mem(a, addr, nbytes), nbytes);
+}
+
+/*
+ * Fill flash memory with pseudo-random data.
+ * Every eighth row is left blank, like gaps in a real image.
+ */
+static void sim_fill(sim_adapter_t *a, unsigned nbytes)
+{
+    unsigned seed = 12345, i;
+
+    if (nbytes > a->flash_bytes)
+        nbytes = a->flash_bytes;
+    for (i=0; i<nbytes; i++) {
+        if (i / a->row_bytes % 8 == 7)
+            continue;
+        seed = seed * 1103515245 + 12345;
+        a->flash[i] = seed >> 16;
+    }
+}
+
+/*
+ * Create a simulated target.
+ * Parameters are given as a comma-separated list.
+ */
+adapter_t *adapter_open_sim(const char *port, int baud_rate)
+{
+    sim_adapter_t *a;
+    char *params, *p, *value;
+    unsigned fill = 0;
+    int cluster = 1, chip = 1, i;
+
+    a = calloc(1, sizeof(*a));
+    params = strdup(port);
+    if (! a || ! params) {
+        fprintf(stderr, "Out of memory\n");
+        goto failed;
+    }
+
+    /* Default timing: high-speed USB adapter,
+     * typical flash timing from the datasheets. */
+    a->usb_usec = 125;
+    a->bandwidth = 1000000;
+    a->word_usec = 20;
+    a->row_usec = 1500;
+    a->page_usec = 20000;
+    a->chip_usec = 80000;
+    a->crc_usec = 100;
+
+    for (p=strtok(params, ","); p; p=strtok(0, ",")) {
+        value = strchr(p, '=');
+        if (! value) {
+            for (i=0; sim_chips[i].name; i++)
+                if (strcasecmp(p, sim_chips[i].name) == 0)
+                    break;
+            if (! sim_chips[i].name) {
+                fprintf(stderr, "sim: unknown chip %s\n", p);
+                goto failed;
+            }
+            chip = i;
+            continue;
+        }
+        *value++ = 0;
+        if (strcmp(p, "usb") == 0)
+            a->usb_usec = strtoul(value, 0, 0);
+        else if (strcmp(p, "bw") == 0)
+            a->bandwidth = strtoul(value, 0, 0);
+        else if (strcmp(p, "word") == 0)
+            a->word_usec = strtoul(value, 0, 0);
+        else if (strcmp(p, "row") == 0)
+            a->row_usec = strtoul(value, 0, 0);
+        else if (strcmp(p, "page") == 0)
+            a->page_usec = strtoul(value, 0, 0);
+        else if (strcmp(p, "chip") == 0)
+            a->chip_usec = strtoul(value, 0, 0);
+        else if (strcmp(p, "crc") == 0)
+            a->crc_usec = strtoul(value, 0, 0);
+        else if (strcmp(p, "cluster") == 0)
+            cluster = strtoul(value, 0, 0);
+        else if (strcmp(p, "fill") == 0)
+            fill = strtoul(value, 0, 0);
+        else if (strcmp(p, "realtime") == 0)
+            a->realtime = strtoul(value, 0, 0);
+        else {
+            fprintf(stderr, "sim: unknown parameter %s\n", p);
+            goto failed;
+        }
+    }
+    free(params);
+    params = 0;
+    if (a->bandwidth == 0)
+        a->bandwidth = 1;
+
+    a->devid = sim_chips[chip].devid;
+    a->row_bytes = sim_chips[chip].row_bytes;
+    a->page_bytes = sim_chips[chip].page_bytes;
+    a->flash_bytes = sim_chips[chip].flash_kbytes * 1024;
+    a->flash = malloc(a->flash_bytes);
+    if (! a->flash) {
+        fprintf(stderr, "Out of memory\n");
+        goto failed;
+    }
+    memset(a->flash, 0xff, a->flash_bytes);
+    memset(a->boot, 0xff, BOOT_BYTES);
+    if (fill)
+        sim_fill(a, fill * 1024);
+
+    printf("      Adapter: Simulator, %s, latency %u usec, %u bytes/sec\n",
+        sim_chips[chip].name, a->usb_usec, a->bandwidth);
+
+    a->adapter.block_override = 0;
+    a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
+
+    /* User functions. */
+    a->adapter.close = sim_close;
+    a->adapter.get_idcode = sim_get_idcode;
+    a->adapter.load_executive = sim_load_executive;
+    a->adapter.read_word = sim_read_word;
+    a->adapter.read_data = sim_read_data;
+    a->adapter.verify_data = sim_verify_data;
+    a->adapter.erase_chip = sim_erase_chip;
+    a->adapter.erase_page = sim_erase_page;
+    a->adapter.get_crc = sim_get_crc;
+    a->adapter.blank_check = sim_blank_check;
+    a->adapter.program_word = sim_program_word;
+    a->adapter.program_row = sim_program_row;
+    if (cluster)
+        a->adapter.program_cluster = sim_program_cluster;
+    a->adapter.program_double_word = sim_program_double_word;
+    a->adapter.program_quad_word = sim_program_quad_word;
+    return &a->adapter;
+
+failed:
+    free(params);
+    if (a)
+        free(a->flash);
+    free(a);
+    return 0;
+}
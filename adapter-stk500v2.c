@@ -63,10 +63,7 @@ typedef struct {
     int             timeout_msec;
     unsigned        baud;
     unsigned char   sequence_number;
-    unsigned char   page_addr_fetched;
-    unsigned        page_addr;
     unsigned        last_load_addr;
-    unsigned char   page [PAGE_NBYTES];
 
 } stk_adapter_t;
 
@@ -190,30 +187,85 @@ flush_input:
     return 1;
 }
 
-static void switch_baud(stk_adapter_t *a)
+/*
+ * Send CMD_SIGN_ON and check the reply.
+ */
+static int sign_on(stk_adapter_t *a, unsigned char *response)
+{
+    return send_receive(a, (unsigned char*)"\1", 1, response, 11) &&
+        (memcmp(response, "\1\0\10STK500_2", 11) == 0 ||
+         memcmp(response, "\1\0\10AVRISP_2", 11) == 0);
+}
+
+/*
+ * Ask the bootloader to change the baud rate.
+ * Return 1 when accepted: the port is switched to the new rate.
+ * Return 0 when the rate is rejected, -1 when no reply.
+ */
+static int set_baud(stk_adapter_t *a, unsigned baud)
 {
     unsigned char cmd [5] = { CMD_SET_BAUD,
-        (alternate_speed) & 0xFF,
-        (alternate_speed >> 8) & 0xFF,
-        (alternate_speed >> 16) & 0xFF,
-        (alternate_speed >> 24) & 0xFF,
+        baud & 0xFF,
+        (baud >> 8) & 0xFF,
+        (baud >> 16) & 0xFF,
+        (baud >> 24) & 0xFF,
     };
     unsigned char response [6];
 
-    if (alternate_speed != a->baud) {
-        if (send_receive(a, cmd, 5, response, 6) &&
-            response[0] == cmd[0] &&
-            response[1] == STATUS_CMD_OK &&
-            response[2] == cmd[1] &&
-            response[3] == cmd[2] &&
-            response[4] == cmd[3] &&
-            response[5] == cmd[4])
-        {
-            serial_baud(alternate_speed);
-            printf("    Baud rate: %d bps\n", alternate_speed);
-        } else {
-            printf("    Baud rate: %d bps\n", a->baud);
+    if (! send_receive(a, cmd, 5, response, 6))
+        return -1;
+    if (response[0] != cmd[0] ||
+        response[1] != STATUS_CMD_OK ||
+        response[2] != cmd[1] ||
+        response[3] != cmd[2] ||
+        response[4] != cmd[3] ||
+        response[5] != cmd[4])
+        return 0;
+
+    serial_baud(baud);
+    a->baud = baud;
+    return 1;
+}
+
+/*
+ * Rates tried by baud negotiation, fastest first.
+ */
+static const unsigned auto_baud_tab[] = {
+    921600, 460800, 230400, 0
+};
+
+static void switch_baud(stk_adapter_t *a)
+{
+    unsigned char response [12];
+    int i;
+
+    if (alternate_speed == 0) {
+        /*
+         * Negotiate: try rates from the fastest one,
+         * until the bootloader accepts it.
+         */
+        for (i=0; auto_baud_tab[i] > a->baud; i++) {
+            if (! serial_speed_valid(auto_baud_tab[i]))
+                continue;
+            int ok = set_baud(a, auto_baud_tab[i]);
+            if (ok < 0)
+                break;
+            if (ok > 0) {
+                if (! sign_on(a, response)) {
+                    fprintf(stderr, "stk: no reply at %u bps, use -B option to select a lower rate\n",
+                        a->baud);
+                    exit(-1);
+                }
+                break;
+            }
         }
+        printf("    Baud rate: %d bps\n", a->baud);
+        return;
+    }
+
+    if (alternate_speed != a->baud) {
+        set_baud(a, alternate_speed);
+        printf("    Baud rate: %d bps\n", a->baud);
     }
 }
 
@@ -312,6 +364,8 @@ static void load_address(stk_adapter_t *a, unsigned addr)
         (addr >> 24), (addr >> 16), addr >> 8, addr, };
     unsigned char response [2];
 
+    /* The bootloader advances the address after every
+     * read or write, so there is often no need to set it again. */
     if (a->last_load_addr == addr)
         return;
 
@@ -326,16 +380,22 @@ static void load_address(stk_adapter_t *a, unsigned addr)
     a->last_load_addr = addr;
 }
 
-static void flush_write_buffer(stk_adapter_t *a)
+/*
+ * Write one page to the flash memory.
+ * The data are taken directly from the caller's buffer.
+ */
+static void program_page(stk_adapter_t *a, unsigned addr,
+    const unsigned char *data)
 {
     unsigned char cmd [10+PAGE_NBYTES] = { CMD_PROGRAM_FLASH_ISP,
         PAGE_NBYTES >> 8, PAGE_NBYTES & 0xff, 0, 0, 0, 0, 0, 0, 0 };
     unsigned char response [2];
 
-    if (! a->page_addr_fetched)
+    /* No need to write 0xFF to erased flash memory. */
+    if (adapter_is_blank(data, PAGE_NBYTES))
         return;
 
-    load_address(a, a->page_addr >> 1);
+    load_address(a, addr >> 1);
 
     /*
      * An early chipKIT bootloader version does a whole-chip erase
@@ -352,41 +412,19 @@ static void flush_write_buffer(stk_adapter_t *a)
     }
 
     if (debug_level > 1)
-        printf("Programming page: %#x\n", a->page_addr);
-    memcpy(cmd+10, a->page, PAGE_NBYTES);
+        printf("Programming page: %#x\n", addr);
+    memcpy(cmd+10, data, PAGE_NBYTES);
     if (! send_receive(a, cmd, 10+PAGE_NBYTES, response, 2) ||
         response[0] != cmd[0]) {
         fprintf(stderr, "Program flash failed.\n");
         exit(-1);
     }
     if (response[1] != STATUS_CMD_OK)
-        printf("Programming flash: timeout at %#x\n", a->page_addr);
+        printf("Programming flash: timeout at %#x\n", addr);
 
-    a->page_addr_fetched = 0;
     a->last_load_addr += PAGE_NBYTES / 2;
 }
 
-/*
- * PAGE MODE PROGRAMMING:
- * Cache page address. When current address is out of the page address,
- * flush page buffer and continue programming.
- */
-static void write_byte(stk_adapter_t *a, unsigned addr, unsigned char byte)
-{
-    if (debug_level > 2)
-        printf("Loading to address: %#x (page_addr_fetched=%s)\n",
-            addr, a->page_addr_fetched ? "Yes" : "No");
-
-    if (a->page_addr / PAGE_NBYTES != addr / PAGE_NBYTES)
-        flush_write_buffer(a);
-
-    if (! a->page_addr_fetched) {
-        a->page_addr = addr / PAGE_NBYTES * PAGE_NBYTES;
-        a->page_addr_fetched = 1;
-    }
-    a->page [addr % PAGE_NBYTES] = byte;
-}
-
 /*
  * Read 256 bytes from the flash memory.
  * For some reason, the chipKIT bootloader fails to read blocks
@@ -414,6 +452,19 @@ static void read_page(stk_adapter_t *a, unsigned addr,
     a->last_load_addr += READ_NBYTES / 2;
 }
 
+/*
+ * Read a block of flash memory, up to 1024 bytes.
+ * Only the pages, which contain the requested words, are fetched.
+ */
+static void read_block(stk_adapter_t *a, unsigned addr,
+    unsigned nwords, unsigned *block)
+{
+    unsigned i;
+
+    for (i=0; i<nwords*4; i+=READ_NBYTES)
+        read_page(a, addr+i, i + (unsigned char*) block);
+}
+
 static void stk_close(adapter_t *adapter, int power_on)
 {
     stk_adapter_t *a = (stk_adapter_t*) adapter;
@@ -517,8 +568,7 @@ static void stk_verify_data(adapter_t *adapter,
     unsigned block [1024/4], i, expected, word;
 
     /* Read block of data. */
-    for (i=0; i<1024; i+=READ_NBYTES)
-        read_page(a, addr+i, i + (unsigned char*) block);
+    read_block(a, addr, nwords, block);
 
     /* Compare. */
     for (i=0; i<nwords; i++) {
@@ -532,6 +582,19 @@ static void stk_verify_data(adapter_t *adapter,
     }
 }
 
+/*
+ * Read a block of memory, up to 1024 bytes.
+ */
+static void stk_read_data(adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
+{
+    stk_adapter_t *a = (stk_adapter_t*) adapter;
+    unsigned block [1024/4];
+
+    read_block(a, addr, nwords, block);
+    memcpy(data, block, nwords * 4);
+}
+
 /*
  * Flash write, 1-kbyte blocks.
  */
@@ -541,13 +604,8 @@ static void stk_program_block(adapter_t *adapter,
     stk_adapter_t *a = (stk_adapter_t*) adapter;
     unsigned i;
 
-    for (i=0; i<1024/4; ++i) {
-        write_byte(a, addr + i*4,     data[i]);
-        write_byte(a, addr + i*4 + 1, data[i] >> 8);
-        write_byte(a, addr + i*4 + 2, data[i] >> 16);
-        write_byte(a, addr + i*4 + 3, data[i] >> 24);
-    }
-    flush_write_buffer(a);
+    for (i=0; i<1024; i+=PAGE_NBYTES)
+        program_page(a, addr+i, i + (unsigned char*) data);
 }
 
 adapter_t *adapter_open_stk500v2(const char *port, int baud_rate)
@@ -580,10 +638,7 @@ adapter_t *adapter_open_stk500v2(const char *port, int baud_rate)
     int outer_retry = 0;
     for (;;) {
         /* Send CMD_SIGN_ON. */
-        if (send_receive(a, (unsigned char*)"\1", 1, response, 11) &&
-            ((memcmp(response, "\1\0\10STK500_2", 11) == 0)
-            ||
-            (memcmp(response, "\1\0\10AVRISP_2", 11) == 0))) {
+        if (sign_on(a, response)) {
             if (debug_level > 1)
                 printf("stk-probe: OK\n");
             break;
@@ -623,6 +678,7 @@ adapter_t *adapter_open_stk500v2(const char *port, int baud_rate)
     a->adapter.user_nbytes = 2048 * 1024;
     a->adapter.boot_nbytes = 80 * 1024;
     a->adapter.block_override = 1024;
+    a->adapter.read_max_words = 1024/4;
     a->adapter.flags = (AD_PROBE | AD_ERASE | AD_READ | AD_WRITE);
 
     printf(" Program area: %08x-%08x\n", a->adapter.user_start,
@@ -632,6 +688,7 @@ adapter_t *adapter_open_stk500v2(const char *port, int baud_rate)
     a->adapter.close = stk_close;
     a->adapter.get_idcode = stk_get_idcode;
     a->adapter.read_word = stk_read_word;
+    a->adapter.read_data = stk_read_data;
     a->adapter.verify_data = stk_verify_data;
     a->adapter.program_block = stk_program_block;
     a->adapter.program_word = stk_program_word;
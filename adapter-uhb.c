@@ -17,6 +17,7 @@
 #include "adapter.h"
 #include "hidapi.h"
 #include "pic32.h"
+#include "stats.h"
 
 /* Bootloader commands */
 #define CMD_NON     0           /* 'Idle' */
@@ -94,7 +95,9 @@ static void uhb_command(uhb_adapter_t *a, unsigned char cmd,
         }
         fprintf(stderr, "\n");
     }
+    unsigned long long t0 = stats_time();
     hid_write(a->hiddev, buf, 64);
+    stats_event(STAT_USB_OUT, 64, t0);
 
     if (cmd == CMD_REBOOT) {
         /* No reply expected. */
@@ -113,14 +116,18 @@ static void uhb_command(uhb_adapter_t *a, unsigned char cmd,
                 }
                 fprintf(stderr, "\n");
             }
+            t0 = stats_time();
             hid_write(a->hiddev, data, 64);
+            stats_event(STAT_USB_OUT, 64, t0);
             data += 64;
         }
     }
 
     /* Get reply. */
     memset(a->reply, 0, sizeof(a->reply));
+    t0 = stats_time();
     reply_len = hid_read_timeout(a->hiddev, a->reply, 64, 500);
+    stats_event(STAT_USB_IN, reply_len > 0 ? reply_len : 0, t0);
     if (reply_len == 0) {
         fprintf(stderr, "Timed out.\n");
         exit(-1);
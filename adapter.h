@@ -26,6 +26,7 @@ struct _adapter_t {
     unsigned boot_nbytes;               /* Size of user boot area */
 
     unsigned block_override;            /* Overridden block size for target */
+    unsigned read_max_words;            /* Limit of read_data size, 0 when none */
 
     unsigned flags;
     const char *family_name;            /* Name of pic32 family */
@@ -40,10 +41,15 @@ struct _adapter_t {
     void (*program_quad_word)(adapter_t *a, unsigned addr, unsigned word0,
         unsigned word1, unsigned word2, unsigned word3);
     void (*program_row)(adapter_t *a, unsigned addr, unsigned *data, unsigned words_per_row);
+    void (*program_cluster)(adapter_t *a, unsigned addr, unsigned *data, unsigned nwords,
+        unsigned words_per_row);
     void (*program_word)(adapter_t *a, unsigned addr, unsigned word);
     void (*program_double_word)(adapter_t *a, unsigned addr, unsigned word0, unsigned word1);
     unsigned (*read_word)(adapter_t *a, unsigned addr);
     void (*erase_chip)(adapter_t *a);
+    void (*erase_page)(adapter_t *a, unsigned addr, unsigned npages);
+    unsigned (*get_crc)(adapter_t *a, unsigned addr, unsigned nbytes);
+    int (*blank_check)(adapter_t *a, unsigned addr, unsigned nbytes);
 };
 
 adapter_t *adapter_open_pickit2(int vid, int pid, const char *serial);
@@ -55,8 +61,10 @@ adapter_t *adapter_open_bitbang(const char *port, int baud_rate);
 adapter_t *adapter_open_an1388_uart(const char *port, int baud_rate);
 adapter_t *adapter_open_stk500v2(const char *port, int baud_rate);
 adapter_t *adapter_open_uhb(int vid, int pid, const char *serial);
+adapter_t *adapter_open_sim(const char *port, int baud_rate);
 
 void mdelay(unsigned msec);
+int adapter_is_blank(const void *data, unsigned nbytes);
 extern int debug_level;
 
 #endif
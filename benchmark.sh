@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Throughput benchmark on the simulated target.
+# For every family, an image is created by reading a pre-filled
+# simulator, then programmed and verified on a blank one.
+# Usage: sh benchmark.sh [path-to-pic32prog] [extra sim parameters]
+#
+PROG=${1:-./pic32prog}
+PARAMS=${2:+,$2}
+TMP=`mktemp -d ${TMPDIR:-/tmp}/pic32bench.XXXXXX` || exit 1
+trap 'rm -rf $TMP' 0
+
+failed=0
+for spec in mx1:128 mx3:384 mz:1024; do
+    chip=${spec%:*}
+    kbytes=${spec#*:}
+    image=$TMP/$chip.hex
+
+    echo "=== $chip, $kbytes kbytes"
+    $PROG -d sim:$chip,fill=$kbytes$PARAMS -r $image \
+        0x1d000000 $(($kbytes * 1024)) > $TMP/read.log || {
+        cat $TMP/read.log
+        failed=1
+        continue
+    }
+    grep -E 'Rate|Simulated' $TMP/read.log | sed 's/^ */Read:    /'
+
+    $PROG -d sim:$chip$PARAMS --stats $image > $TMP/program.log || {
+        cat $TMP/program.log
+        failed=1
+        continue
+    }
+    sed -n '/^Simulation:/,$p' $TMP/program.log
+    if grep -q 'over non-blank' $TMP/program.log; then
+        failed=1
+    fi
+done
+exit $failed
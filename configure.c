@@ -321,9 +321,15 @@ static void configure_parameter(char *section, char *param, char *value)
  */
 void target_configure()
 {
+    static int configured;
     FILE *fp;
     int c;
 
+    /* Read the file only once per process. */
+    if (configured)
+        return;
+    configured = 1;
+
     /*
      * Find the configuration file, if any.
      * (1) First, try a path from PIC32PROG_CONF_FILE environment variable.
@@ -0,0 +1,19 @@
+/*
+ * CRC-CCITT checksum, as computed by the programming executive
+ * and the AN1388 bootloader.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#ifndef _CRC_H
+#define _CRC_H
+
+/*
+ * Update CRC with a block of data.
+ * The PE uses initial value 0xffff, the bootloader uses 0.
+ * Can be called repeatedly for consecutive fragments of data.
+ */
+unsigned calculate_crc(unsigned crc, const unsigned char *data, unsigned nbytes);
+
+#endif
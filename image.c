@@ -0,0 +1,250 @@
+/*
+ * Sparse memory image of the target.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "crc.h"
+
+/*
+ * Contents of missing chunks.
+ */
+static unsigned blank [IMAGE_CHUNK / 4];
+
+void image_init(image_t *im, unsigned limit)
+{
+    memset(blank, ~0, sizeof(blank));
+    memset(im, 0, sizeof(*im));
+    im->limit = limit;
+    im->nchunks = (limit + IMAGE_CHUNK - 1) / IMAGE_CHUNK;
+    im->chunk = calloc(im->nchunks, sizeof(image_chunk_t*));
+    if (! im->chunk) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+}
+
+void image_free(image_t *im)
+{
+    unsigned i;
+
+    for (i=0; i<im->nchunks; i++) {
+        if (im->chunk[i])
+            free(im->chunk[i]);
+    }
+    free(im->chunk);
+    free(im->extent);
+    memset(im, 0, sizeof(*im));
+}
+
+/*
+ * Get a chunk for writing, allocate when needed.
+ */
+static image_chunk_t *image_chunk(image_t *im, unsigned offset)
+{
+    image_chunk_t **c = &im->chunk [offset / IMAGE_CHUNK];
+
+    if (! *c) {
+        *c = malloc(sizeof(image_chunk_t));
+        if (! *c) {
+            fprintf(stderr, "Out of memory\n");
+            exit(-1);
+        }
+        memset((*c)->data, ~0, sizeof((*c)->data));
+        memset((*c)->dirty, 0, sizeof((*c)->dirty));
+    }
+    return *c;
+}
+
+/*
+ * Add a range to the sorted list of extents,
+ * merging it with overlapping or adjacent ones.
+ */
+static void image_add_extent(image_t *im, unsigned start, unsigned end)
+{
+    extent_t *e;
+    unsigned i, j;
+
+    /* Sequential data: extend the last extent. */
+    if (im->nextents > 0) {
+        e = &im->extent [im->nextents - 1];
+        if (start >= e->start && start <= e->end) {
+            if (end > e->end)
+                e->end = end;
+            return;
+        }
+    }
+
+    /* Find extents which touch the new range. */
+    for (i=0; i<im->nextents && im->extent[i].end < start; i++)
+        continue;
+    for (j=i; j<im->nextents && im->extent[j].start <= end; j++) {
+        if (im->extent[j].start < start)
+            start = im->extent[j].start;
+        if (im->extent[j].end > end)
+            end = im->extent[j].end;
+    }
+
+    if (j == i) {
+        /* Insert a new extent at position i. */
+        if (im->nextents == im->maxextents) {
+            im->maxextents = im->maxextents ? im->maxextents * 2 : 16;
+            im->extent = realloc(im->extent, im->maxextents * sizeof(extent_t));
+            if (! im->extent) {
+                fprintf(stderr, "Out of memory\n");
+                exit(-1);
+            }
+        }
+        memmove(&im->extent[i+1], &im->extent[i],
+            (im->nextents - i) * sizeof(extent_t));
+        im->nextents++;
+    } else {
+        /* Replace extents i..j-1 with a single one. */
+        memmove(&im->extent[i+1], &im->extent[j],
+            (im->nextents - j) * sizeof(extent_t));
+        im->nextents -= j - i - 1;
+    }
+    im->extent[i].start = start;
+    im->extent[i].end = end;
+}
+
+void image_store(image_t *im, unsigned offset,
+    const unsigned char *data, unsigned nbytes)
+{
+    image_chunk_t *c;
+    unsigned char *p;
+    unsigned n, i;
+
+    if (nbytes == 0)
+        return;
+    image_add_extent(im, offset, offset + nbytes);
+
+    while (nbytes > 0) {
+        c = image_chunk(im, offset);
+        p = (unsigned char*) c->data;
+        n = IMAGE_CHUNK - offset % IMAGE_CHUNK;
+        if (n > nbytes)
+            n = nbytes;
+
+        memcpy(p + offset % IMAGE_CHUNK, data, n);
+        for (i=0; i<n; i++) {
+            if (data[i] != 0xff) {
+                unsigned b = (offset + i) % IMAGE_CHUNK / IMAGE_MINBLOCK;
+                c->dirty [b / 8] |= 1 << (b % 8);
+            }
+        }
+        offset += n;
+        data += n;
+        nbytes -= n;
+    }
+}
+
+const unsigned char *image_read(image_t *im, unsigned offset)
+{
+    image_chunk_t *c = 0;
+
+    if (offset < im->limit)
+        c = im->chunk [offset / IMAGE_CHUNK];
+    if (! c)
+        return (unsigned char*) blank + offset % IMAGE_CHUNK;
+    return (unsigned char*) c->data + offset % IMAGE_CHUNK;
+}
+
+unsigned image_word(image_t *im, unsigned offset)
+{
+    const unsigned char *p = image_read(im, offset);
+
+    return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+
+int image_is_dirty(image_t *im, unsigned offset, unsigned nbytes)
+{
+    image_chunk_t *c;
+    unsigned b, end = offset + nbytes;
+
+    if (end > im->limit)
+        end = im->limit;
+    while (offset < end) {
+        c = im->chunk [offset / IMAGE_CHUNK];
+        if (! c) {
+            /* Skip missing chunk. */
+            offset = (offset / IMAGE_CHUNK + 1) * IMAGE_CHUNK;
+            continue;
+        }
+        b = offset % IMAGE_CHUNK / IMAGE_MINBLOCK;
+        if (c->dirty [b / 8] & (1 << (b % 8)))
+            return 1;
+        offset += IMAGE_MINBLOCK;
+    }
+    return 0;
+}
+
+void image_set_dirty(image_t *im, unsigned offset, unsigned nbytes, int on)
+{
+    image_chunk_t *c;
+    unsigned b, end = offset + nbytes;
+
+    if (end > im->limit)
+        end = im->limit;
+    for (; offset < end; offset += IMAGE_MINBLOCK) {
+        if (on)
+            c = image_chunk(im, offset);
+        else if (! (c = im->chunk [offset / IMAGE_CHUNK]))
+            continue;
+        b = offset % IMAGE_CHUNK / IMAGE_MINBLOCK;
+        if (on)
+            c->dirty [b / 8] |= 1 << (b % 8);
+        else
+            c->dirty [b / 8] &= ~(1 << (b % 8));
+    }
+}
+
+unsigned image_next_dirty(image_t *im, unsigned offset,
+    unsigned blocksz, unsigned limit)
+{
+    if (limit > im->limit)
+        limit = im->limit;
+
+    while (offset < limit) {
+        if (! im->chunk [offset / IMAGE_CHUNK]) {
+            /* Skip missing chunk. */
+            offset = (offset / IMAGE_CHUNK + 1) * IMAGE_CHUNK;
+            continue;
+        }
+        if (image_is_dirty(im, offset, blocksz))
+            return offset;
+        offset += blocksz;
+    }
+    return limit;
+}
+
+int image_is_written(image_t *im, unsigned offset, unsigned nbytes)
+{
+    unsigned i;
+
+    for (i=0; i<im->nextents && im->extent[i].end <= offset; i++)
+        continue;
+    return i < im->nextents && im->extent[i].start <= offset &&
+        im->extent[i].end >= offset + nbytes;
+}
+
+unsigned image_crc(image_t *im, unsigned crc, unsigned offset, unsigned nbytes)
+{
+    unsigned n;
+
+    while (nbytes > 0) {
+        n = IMAGE_CHUNK - offset % IMAGE_CHUNK;
+        if (n > nbytes)
+            n = nbytes;
+        crc = calculate_crc(crc, image_read(im, offset), n);
+        offset += n;
+        nbytes -= n;
+    }
+    return crc;
+}
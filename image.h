@@ -0,0 +1,84 @@
+/*
+ * Sparse memory image of the target.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+/*
+ * Data is kept in chunks, allocated on demand and filled with 0xFF.
+ * Chunk size is a multiple of any flash page and block size.
+ * A dirty bit is maintained for every IMAGE_MINBLOCK bytes:
+ * it is set when non-blank data is stored.
+ */
+#define IMAGE_CHUNK     16384
+#define IMAGE_MINBLOCK  128
+
+typedef struct {
+    unsigned        data [IMAGE_CHUNK / 4];
+    unsigned char   dirty [IMAGE_CHUNK / IMAGE_MINBLOCK / 8];
+} image_chunk_t;
+
+/*
+ * Range of written data: start..end-1.
+ */
+typedef struct {
+    unsigned        start;
+    unsigned        end;
+} extent_t;
+
+typedef struct {
+    unsigned        limit;          /* Max size of memory region */
+    unsigned        nchunks;        /* Size of chunk table */
+    image_chunk_t   **chunk;        /* Chunks of data, 0 when blank */
+    unsigned        nextents;       /* Sorted list of written extents */
+    unsigned        maxextents;
+    extent_t        *extent;
+} image_t;
+
+void image_init(image_t *im, unsigned limit);
+void image_free(image_t *im);
+
+/*
+ * Store data at the given offset.
+ */
+void image_store(image_t *im, unsigned offset,
+    const unsigned char *data, unsigned nbytes);
+
+/*
+ * Get pointer to the data at given offset.
+ * Valid up to the end of the chunk, i.e. for any
+ * block or page aligned to its size.
+ * Blank memory is returned for missing chunks.
+ */
+const unsigned char *image_read(image_t *im, unsigned offset);
+unsigned image_word(image_t *im, unsigned offset);
+
+/*
+ * Dirty bits: get, set or clear for a range of memory.
+ */
+int image_is_dirty(image_t *im, unsigned offset, unsigned nbytes);
+void image_set_dirty(image_t *im, unsigned offset, unsigned nbytes, int on);
+
+/*
+ * Find the next dirty block at or after the given offset.
+ * Only chunks holding data are scanned.
+ * Return the offset of the block, or limit when none found.
+ */
+unsigned image_next_dirty(image_t *im, unsigned offset,
+    unsigned blocksz, unsigned limit);
+
+/*
+ * Check whether the range lies within one written extent.
+ */
+int image_is_written(image_t *im, unsigned offset, unsigned nbytes);
+
+/*
+ * Update CRC with the data of a range, which may span several chunks.
+ */
+unsigned image_crc(image_t *im, unsigned crc, unsigned offset, unsigned nbytes);
+
+#endif
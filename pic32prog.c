@@ -19,35 +19,49 @@
 #include <time.h>
 #include <libgen.h>
 #include <locale.h>
+#ifndef MINGW32
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/select.h>
+#   include <sys/wait.h>
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#   include <errno.h>
+#   include <pthread.h>
+#endif
 
 #include "target.h"
 #include "serial.h"
 #include "localize.h"
 #include "adapter.h"
+#include "image.h"
+#include "stats.h"
 
 #ifndef VERSION
 #define VERSION         "2.0."GITCOUNT
 #endif
-#define MINBLOCKSZ          128
 #define FLASHV_KSEG0_BASE   0x9d000000
 #define BOOTV_KSEG0_BASE    0x9fc00000
 #define FLASHV_KSEG1_BASE   0xBD000000
 #define BOOTV_KSEG1_BASE    0xBFC00000
 #define FLASHP_BASE     0x1d000000
 #define BOOTP_BASE      0x1fc00000
-#define FLASH_BYTES     (2048 * 1024)
+#define FLASH_BYTES     (BOOTP_BASE - FLASHP_BASE)
 #define BOOT_BYTES      (80 * 1024)
 
-/* Macros for converting between hex and binary. */
-#define NIBBLE(x)       (isdigit(x) ? (x)-'0' : tolower(x)+10-'a')
-#define HEX(buffer)     ((NIBBLE((buffer)[0])<<4) + NIBBLE((buffer)[1]))
+/* Iterate over dirty blocks of the image. */
+#define for_each_dirty_block(addr, im, nbytes) \
+    for (addr = image_next_dirty(im, 0, blocksz, nbytes); addr < (nbytes); \
+         addr = image_next_dirty(im, addr + blocksz, blocksz, nbytes))
+
+/* Values of hex digits, -1 for other characters. */
+static signed char hex_digit [256];
 
 /* Data to write */
-unsigned char boot_data [BOOT_BYTES];
-unsigned char flash_data [FLASH_BYTES];
-unsigned char boot_dirty [BOOT_BYTES / MINBLOCKSZ];
-unsigned char flash_dirty [FLASH_BYTES / MINBLOCKSZ];
+image_t boot_image;
+image_t flash_image;
 unsigned blocksz;               /* Size of flash memory block */
+unsigned read_chunk = 65536;    /* Size of chunk for memory read */
 unsigned boot_used;
 unsigned char bootv_kseg = 1;    // Default to 1, same as before. Set in store_data.
 unsigned char flashv_kseg = 1;   // Default to 1, same as before. Set in store_data.
@@ -57,21 +71,31 @@ unsigned flash_bytes;
 unsigned devcfg_offset;         /* Offset of devcfg registers in boot data */
 int total_bytes;
 
-#define devcfg3 (*(unsigned*) &boot_data [devcfg_offset])
-#define devcfg2 (*(unsigned*) &boot_data [devcfg_offset + 4])
-#define devcfg1 (*(unsigned*) &boot_data [devcfg_offset + 8])
-#define devcfg0 (*(unsigned*) &boot_data [devcfg_offset + 12])
+#define devcfg3 image_word(&boot_image, devcfg_offset)
+#define devcfg2 image_word(&boot_image, devcfg_offset + 4)
+#define devcfg1 image_word(&boot_image, devcfg_offset + 8)
+#define devcfg0 image_word(&boot_image, devcfg_offset + 12)
 
 unsigned progress_count;
 int verify_only;
 int erase_only = 0;
 int skip_verify = 0;
+int diff_mode = 0;              /* Rewrite only pages which differ */
+int page_erase = 0;             /* Erase only the pages of the image */
+int blank_only = 0;             /* Check chip for blank */
 int debug_level;
 int power_on;
 target_t *target;
 const char *target_port;        /* Optional name of target serial or USB port */
+#define MAXGANG         16
+const char *gang_port [MAXGANG];  /* Ports for gang programming */
+int gang_count;
+int gang_index;                 /* Number of target in gang, 0 when single */
+int executive_loaded;           /* PE is running on the target */
+const char *error_reason;       /* Why the last command failed */
 int target_speed = 115200;      /* Baud rate for serial port */
 int alternate_speed = 115200;   /* Alternate speed for serial port */
+int jtag_khz;                   /* TCK rate for JTAG adapters, -1 for auto */
 char *progname;
 const char *copyright;
 
@@ -96,151 +120,267 @@ unsigned mseconds_elapsed(void *arg)
     return mseconds;
 }
 
-void store_data(unsigned address, unsigned byte)
-{
-    unsigned offset;
-
-    if (address >= BOOTV_KSEG0_BASE && address < BOOTV_KSEG0_BASE + BOOT_BYTES) {
-        /* Boot code, virtual. KSEG0! */
-        offset = address - BOOTV_KSEG0_BASE;
-        boot_data [offset] = byte;
-        boot_used = 1;
-        bootv_kseg = 0;
-    } else if (address >= BOOTV_KSEG1_BASE && address < BOOTV_KSEG1_BASE + BOOT_BYTES) {
-        /* Boot code, virtual. KSEG1! */
-        offset = address - BOOTV_KSEG1_BASE;
-        boot_data [offset] = byte;
-        boot_used = 1;
-        bootv_kseg = 1;
-    } else if (address >= BOOTP_BASE && address < BOOTP_BASE + BOOT_BYTES) {
-        /* Boot code, physical. */
-        offset = address - BOOTP_BASE;
-        boot_data [offset] = byte;
-        boot_used = 1;
-    } else if (address >= FLASHV_KSEG1_BASE && address < FLASHV_KSEG1_BASE + FLASH_BYTES) {
-        /* Main flash memory, virtual. */
-        offset = address - FLASHV_KSEG1_BASE;
-        flash_data [offset] = byte;
-        flash_used = 1;
-        flashv_kseg = 1;
-    }
-    else if (address >= FLASHV_KSEG0_BASE && address < FLASHV_KSEG0_BASE + FLASH_BYTES) {
-        /* Main flash memory, virtual. */
-        offset = address - FLASHV_KSEG0_BASE;
-        flash_data [offset] = byte;
-        flash_used = 1;
-        flashv_kseg = 0;
-    } else if (address >= FLASHP_BASE && address < FLASHP_BASE + FLASH_BYTES) {
-        /* Main flash memory, physical. */
-        offset = address - FLASHP_BASE;
-        flash_data [offset] = byte;
-        flash_used = 1;
-    } else {
-        /* Ignore incorrect data. */
-        //fprintf(stderr, _("%08X: address out of flash memory\n"), address);
-        return;
+/*
+ * Store a range of data to the image.
+ * One address lookup per record, unless it crosses a region boundary.
+ */
+void store_data(unsigned address, const unsigned char *data, unsigned nbytes)
+{
+    image_t *im;
+    unsigned offset, room, n;
+
+    while (nbytes > 0) {
+        if (address >= BOOTV_KSEG0_BASE && address < BOOTV_KSEG0_BASE + BOOT_BYTES) {
+            /* Boot code, virtual. KSEG0! */
+            offset = address - BOOTV_KSEG0_BASE;
+            room = BOOT_BYTES - offset;
+            im = &boot_image;
+            boot_used = 1;
+            bootv_kseg = 0;
+        } else if (address >= BOOTV_KSEG1_BASE && address < BOOTV_KSEG1_BASE + BOOT_BYTES) {
+            /* Boot code, virtual. KSEG1! */
+            offset = address - BOOTV_KSEG1_BASE;
+            room = BOOT_BYTES - offset;
+            im = &boot_image;
+            boot_used = 1;
+            bootv_kseg = 1;
+        } else if (address >= BOOTP_BASE && address < BOOTP_BASE + BOOT_BYTES) {
+            /* Boot code, physical. */
+            offset = address - BOOTP_BASE;
+            room = BOOT_BYTES - offset;
+            im = &boot_image;
+            boot_used = 1;
+        } else if (address >= FLASHV_KSEG1_BASE && address < FLASHV_KSEG1_BASE + FLASH_BYTES) {
+            /* Main flash memory, virtual. */
+            offset = address - FLASHV_KSEG1_BASE;
+            room = FLASH_BYTES - offset;
+            im = &flash_image;
+            flash_used = 1;
+            flashv_kseg = 1;
+        }
+        else if (address >= FLASHV_KSEG0_BASE && address < FLASHV_KSEG0_BASE + FLASH_BYTES) {
+            /* Main flash memory, virtual. */
+            offset = address - FLASHV_KSEG0_BASE;
+            room = FLASH_BYTES - offset;
+            im = &flash_image;
+            flash_used = 1;
+            flashv_kseg = 0;
+        } else if (address >= FLASHP_BASE && address < FLASHP_BASE + FLASH_BYTES) {
+            /* Main flash memory, physical. */
+            offset = address - FLASHP_BASE;
+            room = FLASH_BYTES - offset;
+            im = &flash_image;
+            flash_used = 1;
+        } else {
+            /* Ignore incorrect data. */
+            //fprintf(stderr, _("%08X: address out of flash memory\n"), address);
+            address++;
+            data++;
+            nbytes--;
+            continue;
+        }
+        n = (nbytes < room) ? nbytes : room;
+        image_store(im, offset, data, n);
+        total_bytes += n;
+        address += n;
+        data += n;
+        nbytes -= n;
     }
-    total_bytes++;
 }
 
 /*
- * Read the S record file.
+ * Map the whole file into memory.
+ * Return 0 on error.
  */
-int read_srec(char *filename)
+static const unsigned char *map_file(const char *filename, size_t *size)
 {
+    unsigned char *text;
+#ifdef MINGW32
     FILE *fd;
-    unsigned char buf [256];
-    unsigned char *data;
-    unsigned address;
-    int bytes;
+    long len;
 
-    fd = fopen(filename, "r");
+    fd = fopen(filename, "rb");
     if (! fd) {
         perror(filename);
-        exit(1);
+        return 0;
+    }
+    fseek(fd, 0, SEEK_END);
+    len = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    text = malloc(len + 1);
+    if (! text || fread(text, 1, len, fd) != len) {
+        fprintf(stderr, _("%s: read error\n"), filename);
+        fclose(fd);
+        free(text);
+        return 0;
+    }
+    fclose(fd);
+    *size = len;
+#else
+    struct stat st;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return 0;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror(filename);
+        close(fd);
+        return 0;
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return (const unsigned char*) "";
     }
-    while (fgets((char*) buf, sizeof(buf), fd)) {
-        if (buf[0] == '\n')
+    text = mmap(0, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+        perror(filename);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+#endif
+    return text;
+}
+
+static void unmap_file(const unsigned char *text, size_t size)
+{
+#ifdef MINGW32
+    free((void*) text);
+#else
+    if (size > 0)
+        munmap((void*) text, size);
+#endif
+}
+
+/*
+ * Convert pairs of hex digits to bytes.
+ * Return 0 when a non-hex character found.
+ */
+static int decode_hex(const unsigned char *text, unsigned char *data, int nbytes)
+{
+    static int initialized;
+    int hi, lo;
+
+    if (! initialized) {
+        /* Fill the table on first call. */
+        initialized = 1;
+        memset(hex_digit, -1, sizeof(hex_digit));
+        for (hi=0; hi<10; hi++)
+            hex_digit['0' + hi] = hi;
+        for (hi=0; hi<6; hi++)
+            hex_digit['a' + hi] = hex_digit['A' + hi] = 10 + hi;
+    }
+    while (nbytes-- > 0) {
+        hi = hex_digit [text[0]];
+        lo = hex_digit [text[1]];
+        if ((hi | lo) < 0)
+            return 0;
+        *data++ = hi << 4 | lo;
+        text += 2;
+    }
+    return 1;
+}
+
+/*
+ * Get next line of text, without end-of-line characters.
+ * Return 0 at end of text.
+ */
+static int next_line(const unsigned char **text, const unsigned char *end,
+    const unsigned char **line, int *len)
+{
+    const unsigned char *p = *text, *eol;
+
+    if (p >= end)
+        return 0;
+    eol = memchr(p, '\n', end - p);
+    if (! eol)
+        eol = end;
+    *line = p;
+    *text = (eol < end) ? eol + 1 : end;
+    while (eol > p && eol[-1] == '\r')
+        eol--;
+    *len = eol - p;
+    return 1;
+}
+
+/*
+ * Read the S record file.
+ * Return 1 on success, 0 when not SREC, -1 on error.
+ */
+int read_srec(char *filename, const unsigned char *text, size_t size)
+{
+    const unsigned char *end = text + size, *line;
+    unsigned char data [256], sum;
+    unsigned address;
+    int len, bytes, alen, i, lineno = 0;
+
+    while (next_line(&text, end, &line, &len)) {
+        lineno++;
+        if (len == 0)
             continue;
-        if (buf[0] != 'S') {
-            fclose(fd);
+        if (line[0] != 'S')
             return 0;
-        }
-        if (buf[1] == '7' || buf[1] == '8' || buf[1] == '9')
+        if (len > 1 && (line[1] == '7' || line[1] == '8' || line[1] == '9'))
             break;
 
         /* Starting an S-record.  */
-        if (! isxdigit(buf[2]) || ! isxdigit(buf[3])) {
-            fprintf(stderr, _("%s: bad SREC record: %s\n"), filename, buf);
-            exit(1);
+        if (len < 4 || ! decode_hex(line + 2, data, 1)) {
+            fprintf(stderr, _("%s: bad SREC record: %.*s\n"), filename, len, line);
+            return -1;
+        }
+        bytes = data[0];
+        if (line[1] < '1' || line[1] > '3')
+            continue;
+        alen = line[1] - '1' + 2;
+        if (bytes <= alen || len < 4 + bytes*2 ||
+            ! decode_hex(line + 4, data, bytes)) {
+            fprintf(stderr, _("%s: bad SREC record: %.*s\n"), filename, len, line);
+            return -1;
         }
-        bytes = HEX(buf + 2);
-
-        /* Ignore the checksum byte.  */
-        --bytes;
 
-        address = 0;
-        data = buf + 4;
-        switch (buf[1]) {
-        case '3':
-            address = HEX(data);
-            data += 2;
-            --bytes;
-            /* Fall through.  */
-        case '2':
-            address = (address << 8) | HEX(data);
-            data += 2;
-            --bytes;
-            /* Fall through.  */
-        case '1':
-            address = (address << 8) | HEX(data);
-            data += 2;
-            address = (address << 8) | HEX(data);
-            data += 2;
-            bytes -= 2;
-
-            while (bytes-- > 0) {
-                store_data(address++, HEX(data));
-                data += 2;
-            }
-            break;
+        /* Sum of all bytes, including count and checksum, must be 0xff. */
+        sum = bytes;
+        for (i=0; i<bytes; i++)
+            sum += data[i];
+        if (sum != 0xff) {
+            fprintf(stderr, _("%s: line %d: bad SREC checksum\n"), filename, lineno);
+            return -1;
         }
+        address = 0;
+        for (i=0; i<alen; i++)
+            address = (address << 8) | data[i];
+        store_data(address, data + alen, bytes - alen - 1);
     }
-    fclose(fd);
     return 1;
 }
 
 /*
  * Read HEX file.
+ * Return 1 on success, 0 when not HEX, -1 on error.
  */
-int read_hex(char *filename)
+int read_hex(char *filename, const unsigned char *text, size_t size)
 {
-    FILE *fd;
-    unsigned char buf [256], data[16], record_type, sum;
+    const unsigned char *end = text + size, *line;
+    unsigned char data [256+5], record_type, sum;
     unsigned address, high;
-    int bytes, i;
+    int len, bytes, i, lineno = 0;
 
-    fd = fopen(filename, "r");
-    if (! fd) {
-        perror(filename);
-        exit(1);
-    }
     high = 0;
-    while (fgets((char*) buf, sizeof(buf), fd)) {
-        if (buf[0] == '\n')
+    while (next_line(&text, end, &line, &len)) {
+        lineno++;
+        if (len == 0)
             continue;
-        if (buf[0] != ':') {
-            fclose(fd);
+        if (line[0] != ':')
             return 0;
+        if (len < 9 || ! decode_hex(line + 1, data, 4)) {
+            fprintf(stderr, _("%s: bad HEX record: %.*s\n"), filename, len, line);
+            return -1;
         }
-        if (! isxdigit(buf[1]) || ! isxdigit(buf[2]) ||
-            ! isxdigit(buf[3]) || ! isxdigit(buf[4]) ||
-            ! isxdigit(buf[5]) || ! isxdigit(buf[6]) ||
-            ! isxdigit(buf[7]) || ! isxdigit(buf[8])) {
-            fprintf(stderr, _("%s: bad HEX record: %s\n"), filename, buf);
-            exit(1);
-        }
-        record_type = HEX(buf+7);
+        record_type = data[3];
         if (record_type == 1) {
             /* End of file. */
             break;
@@ -250,22 +390,24 @@ int read_hex(char *filename)
             continue;
         }
 
-        bytes = HEX(buf+1);
-        if (strlen((char*) buf) < bytes * 2 + 11) {
+        bytes = data[0];
+        if (len < bytes * 2 + 11) {
             fprintf(stderr, _("%s: too short hex line\n"), filename);
-            exit(1);
+            return -1;
         }
-        address = high << 16 | HEX(buf+3) << 8 | HEX(buf+5);
+        if (! decode_hex(line + 9, data + 4, bytes + 1)) {
+            fprintf(stderr, _("%s: bad HEX record: %.*s\n"), filename, len, line);
+            return -1;
+        }
+        address = high << 16 | data[1] << 8 | data[2];
 
+        /* Sum of all bytes, including checksum, must be zero. */
         sum = 0;
-        for (i=0; i<bytes; ++i) {
-            data [i] = HEX(buf+9 + i + i);
+        for (i=0; i<bytes+5; ++i)
             sum += data [i];
-        }
-        sum += record_type + bytes + (address & 0xff) + (address >> 8 & 0xff);
-        if (sum != (unsigned char) - HEX(buf+9 + bytes + bytes)) {
-            fprintf(stderr, _("%s: bad HEX checksum\n"), filename);
-            exit(1);
+        if (sum != 0) {
+            fprintf(stderr, _("%s: line %d: bad HEX checksum\n"), filename, lineno);
+            return -1;
         }
 
         if (record_type == 4) {
@@ -273,27 +415,137 @@ int read_hex(char *filename)
             if (bytes != 2) {
                 fprintf(stderr, _("%s: invalid HEX linear address record length\n"),
                     filename);
-                exit(1);
+                return -1;
             }
-            high = data[0] << 8 | data[1];
+            high = data[4] << 8 | data[5];
             continue;
         }
         if (record_type != 0) {
             fprintf(stderr, _("%s: unknown HEX record type: %d\n"),
                 filename, record_type);
-            exit(1);
+            return -1;
         }
         //printf("%08x: %u bytes\n", address, bytes);
-        for (i=0; i<bytes; i++) {
-            store_data(address++, data [i]);
+        store_data(address, data + 4, bytes);
+    }
+    return 1;
+}
+
+/*
+ * Get little-endian values from ELF file.
+ */
+#define ELF_HALF(p)     ((p)[0] | (p)[1] << 8)
+#define ELF_WORD(p)     ((p)[0] | (p)[1] << 8 | (p)[2] << 16 | (unsigned) (p)[3] << 24)
+
+/*
+ * Read ELF file: 32-bit little-endian MIPS.
+ * Segments of PT_LOAD type are stored by their load (physical) addresses.
+ * Return 1 on success, 0 when not ELF, -1 on error.
+ */
+int read_elf(char *filename, const unsigned char *text, size_t size)
+{
+    const unsigned char *ph;
+    unsigned phoff, phentsize, phnum, i;
+    unsigned type, offset, paddr, filesz;
+
+    if (size < 52 || memcmp(text, "\177ELF", 4) != 0)
+        return 0;
+    if (text[4] != 1 || text[5] != 1 ||         /* ELFCLASS32, ELFDATA2LSB */
+        ELF_HALF(text + 18) != 8) {             /* EM_MIPS */
+        fprintf(stderr, _("%s: not a 32-bit little-endian MIPS ELF file\n"), filename);
+        return -1;
+    }
+    phoff = ELF_WORD(text + 28);
+    phentsize = ELF_HALF(text + 42);
+    phnum = ELF_HALF(text + 44);
+    if (phnum == 0 || phentsize < 32 ||
+        phoff > size || phnum * phentsize > size - phoff) {
+        fprintf(stderr, _("%s: bad ELF program header table\n"), filename);
+        return -1;
+    }
+
+    for (i=0; i<phnum; i++) {
+        ph = text + phoff + i * phentsize;
+        type = ELF_WORD(ph);
+        offset = ELF_WORD(ph + 4);
+        paddr = ELF_WORD(ph + 12);
+        filesz = ELF_WORD(ph + 16);
+        if (type != 1 || filesz == 0)           /* PT_LOAD */
+            continue;
+        if (offset > size || filesz > size - offset) {
+            fprintf(stderr, _("%s: bad ELF segment at %08X\n"), filename, paddr);
+            return -1;
         }
+        //printf("%08x: %u bytes\n", paddr, filesz);
+        store_data(paddr, text + offset, filesz);
     }
-    fclose(fd);
     return 1;
 }
 
+/*
+ * Parse the code file, without recording stats.
+ * Return 0 on success, -1 on error.
+ */
+static int parse_file(char *filename)
+{
+    const unsigned char *text;
+    size_t size;
+    int status;
+
+    text = map_file(filename, &size);
+    if (! text) {
+        error_reason = "cannot read file";
+        return -1;
+    }
+    status = read_elf(filename, text, size);
+    if (status == 0)
+        status = read_srec(filename, text, size);
+    if (status == 0)
+        status = read_hex(filename, text, size);
+    unmap_file(text, size);
+    if (status == 0)
+        fprintf(stderr, _("%s: bad file format\n"), filename);
+    if (status <= 0) {
+        error_reason = "bad file";
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the code file in any supported format.
+ * Return 0 on success, -1 on error.
+ */
+int read_file(char *filename)
+{
+    int status;
+
+    stats_phase_begin(PHASE_PARSE);
+    status = parse_file(filename);
+    stats_phase_end(PHASE_PARSE);
+    return status;
+}
+
+/*
+ * Clear the image before reading next file.
+ */
+void reset_image()
+{
+    image_free(&boot_image);
+    image_free(&flash_image);
+    image_init(&boot_image, BOOT_BYTES);
+    image_init(&flash_image, FLASH_BYTES);
+    boot_used = 0;
+    flash_used = 0;
+    bootv_kseg = 1;
+    flashv_kseg = 1;
+    total_bytes = 0;
+}
+
 void print_symbols(char symbol, int cnt)
 {
+    if (gang_index)
+        return;
     while (cnt-- > 0)
         putchar(symbol);
 }
@@ -301,7 +553,7 @@ void print_symbols(char symbol, int cnt)
 void progress(unsigned step)
 {
     ++progress_count;
-    if (progress_count % step == 0) {
+    if (progress_count % step == 0 && ! gang_index) {
         putchar('#');
         fflush(stdout);
     }
@@ -314,6 +566,7 @@ void quit(void)
         free(target);
         target = 0;
     }
+    stats_report();
 }
 
 void interrupted(int signum)
@@ -323,48 +576,116 @@ void interrupted(int signum)
     _exit(-1);
 }
 
-/*
- * Check that the boot block, containing devcfg registers,
- * has some useful data.
- */
-static int is_flash_block_dirty(unsigned offset)
-{
-    int i;
-
-    for (i=0; i<blocksz; i++, offset++) {
-        if (flash_data [offset] != 0xff)
-            return 1;
-    }
-    return 0;
-}
-
 /*
  * Check that the boot block, containing devcfg registers,
  * has some other data.
  */
 static int is_boot_block_dirty(unsigned offset)
 {
+    const unsigned char *data = image_read(&boot_image, offset);
     int i;
 
     for (i=0; i<blocksz; i++, offset++) {
         /* Skip devcfg registers. */
         if (offset >= devcfg_offset && offset < devcfg_offset+16)
             continue;
-        if (boot_data [offset] != 0xff)
+        if (data [i] != 0xff)
             return 1;
     }
     return 0;
 }
 
-void do_probe()
+/*
+ * Open and detect the device, unless it is already open.
+ * Return 0 on failure.
+ */
+static int try_open_target()
 {
-    /* Open and detect the device. */
+    if (target)
+        return 1;
     atexit(quit);
+    stats_phase_begin(PHASE_OPEN);
     target = target_open(target_port, target_speed);
+    stats_phase_end(PHASE_OPEN);
     if (! target) {
         fprintf(stderr, _("Error detecting device -- check cable!\n"));
+        return 0;
+    }
+    return 1;
+}
+
+static void open_target()
+{
+    if (! try_open_target())
+        exit(1);
+}
+
+#ifndef MINGW32
+typedef struct {
+    char                *filename;
+    int                 status;
+    unsigned long long  t0, t1;
+} parse_job_t;
+
+/*
+ * Parse the file in a separate thread.
+ * Only times are taken here: the stats and the trace file
+ * are updated by the main thread, after join.
+ */
+static void *read_file_thread(void *arg)
+{
+    parse_job_t *job = arg;
+
+    job->t0 = stats_time();
+    job->status = parse_file(job->filename);
+    job->t1 = stats_time();
+    return 0;
+}
+#endif
+
+/*
+ * Read the code file and open the target at the same time.
+ * The file is parsed by a separate thread, while the adapter
+ * is being detected. The target is not erased or written here,
+ * so a bad file leaves the chip intact.
+ */
+static void open_target_and_read_file(char *filename)
+{
+#ifndef MINGW32
+    pthread_t thread;
+    parse_job_t job;
+
+    job.filename = filename;
+    if (pthread_create(&thread, 0, read_file_thread, &job) == 0) {
+        int opened = try_open_target();
+
+        /* Join before any exit, as the thread may still be parsing. */
+        pthread_join(thread, 0);
+        stats_phase_add(PHASE_PARSE, job.t0, job.t1);
+        if (! opened || job.status < 0)
+            exit(1);
+        return;
+    }
+#endif
+    if (read_file(filename) < 0)
         exit(1);
+    open_target();
+}
+
+/*
+ * Start PE, unless it is already running.
+ */
+static void use_executive()
+{
+    if (! executive_loaded) {
+        target_use_executive(target);
+        executive_loaded = 1;
     }
+}
+
+void do_probe()
+{
+    open_target();
 
     if ((target->adapter->flags & AD_PROBE) == 0) {
         fprintf(stderr, _("Error: Target probe not supported.\n"));
@@ -381,71 +702,180 @@ void do_probe()
 }
 
 /*
- * Write flash memory.
+ * Find the end of a run of contiguous dirty blocks, starting
+ * at the given dirty block. The run does not cross the end
+ * of an image chunk, so the data are contiguous in memory.
  */
-void program_block(target_t *mc, unsigned addr)
+static unsigned dirty_run_end(image_t *im, unsigned addr, unsigned nbytes)
 {
-    unsigned char *data;
-    unsigned offset;
+    do {
+        addr += blocksz;
+    } while (addr < nbytes && addr % IMAGE_CHUNK != 0 &&
+        image_next_dirty(im, addr, blocksz, nbytes) == addr);
+    return addr;
+}
 
-    if (addr >= BOOTV_KSEG0_BASE && addr < BOOTV_KSEG0_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTV_KSEG0_BASE;
-    } else if (addr >= BOOTV_KSEG1_BASE && addr < BOOTV_KSEG1_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTV_KSEG1_BASE;
-    } else if (addr >= BOOTP_BASE && addr < BOOTP_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTP_BASE;
-    } else if (addr >= FLASHV_KSEG0_BASE && addr < FLASHV_KSEG0_BASE + flash_bytes) {
-        data = flash_data;
-        offset = addr - FLASHV_KSEG0_BASE;
-    } else if (addr >= FLASHV_KSEG1_BASE && addr < FLASHV_KSEG1_BASE + flash_bytes) {
-        data = flash_data;
-        offset = addr - FLASHV_KSEG1_BASE;
-    } else {
-        data = flash_data;
-        offset = addr - FLASHP_BASE;
-    }
-    target_program_block(mc, addr, blocksz/4, (unsigned*) (data + offset));
-}
-
-int verify_block(target_t *mc, unsigned addr)
-{
-    unsigned char *data;
-    unsigned offset;
-
-    if (addr >= BOOTV_KSEG0_BASE && addr < BOOTV_KSEG0_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTV_KSEG0_BASE;
-    } if (addr >= BOOTV_KSEG1_BASE && addr < BOOTV_KSEG1_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTV_KSEG1_BASE;
-    } else if (addr >= BOOTP_BASE && addr < BOOTP_BASE + boot_bytes) {
-        data = boot_data;
-        offset = addr - BOOTP_BASE;
-    } else if (addr >= FLASHV_KSEG0_BASE && addr < FLASHV_KSEG0_BASE + flash_bytes) {
-        data = flash_data;
-        offset = addr - FLASHV_KSEG0_BASE;
-    } else if (addr >= FLASHV_KSEG1_BASE && addr < FLASHV_KSEG1_BASE + flash_bytes) {
-        data = flash_data;
-        offset = addr - FLASHV_KSEG1_BASE;
-    } else {
-        data = flash_data;
-        offset = addr - FLASHP_BASE;
+/*
+ * Page erase mode: erase the pages below the given offset,
+ * which hold any data of the image, and were not erased yet.
+ * Adjacent pages are erased by one command.
+ */
+static void erase_pages_until(target_t *mc, image_t *im, unsigned base,
+    unsigned *erased, unsigned end)
+{
+    unsigned pagesz = target_page_size(mc);
+    unsigned i, start, stop;
+
+    end = (end + pagesz - 1) / pagesz * pagesz;
+    for (i=0; i<im->nextents && *erased < end; i++) {
+        start = im->extent[i].start / pagesz * pagesz;
+        stop = (im->extent[i].end + pagesz - 1) / pagesz * pagesz;
+        if (start < *erased)
+            start = *erased;
+        if (stop > end)
+            stop = end;
+        if (start >= stop)
+            continue;
+        target_erase_pages(mc, base + start, (stop - start) / pagesz);
+        *erased = stop;
     }
-    target_verify_block(mc, addr, blocksz/4, (unsigned*) (data + offset));
+    if (*erased < end)
+        *erased = end;
+}
+
+/*
+ * Program all dirty blocks of the memory region.
+ * Runs of contiguous blocks are passed to the target at once,
+ * so that the adapter can send them with a single command.
+ * In page erase mode, the pages of every run are erased
+ * just before it is programmed.
+ */
+void program_region(target_t *mc, image_t *im, unsigned base,
+    unsigned nbytes, unsigned step)
+{
+    unsigned addr, run_end, erased = 0;
+
+    stats_phase_begin(PHASE_PROGRAM);
+    addr = image_next_dirty(im, 0, blocksz, nbytes);
+    while (addr < nbytes) {
+        run_end = dirty_run_end(im, addr, nbytes);
+        if (page_erase)
+            erase_pages_until(mc, im, base, &erased, run_end);
+        target_program_block(mc, base + addr, (run_end - addr) / 4,
+            (unsigned*) image_read(im, addr));
+        for (; addr < run_end; addr += blocksz)
+            progress(step);
+        addr = image_next_dirty(im, run_end, blocksz, nbytes);
+    }
+
+    /* Blank data of the image, and devcfg registers. */
+    if (page_erase)
+        erase_pages_until(mc, im, base, &erased, nbytes);
+    stats_phase_end(PHASE_PROGRAM);
+}
+
+int verify_block(target_t *mc, image_t *im, unsigned base, unsigned offset)
+{
+    target_verify_block(mc, base + offset, blocksz/4,
+        (unsigned*) image_read(im, offset));
     return 1;
 }
 
-void do_erase()
+/*
+ * Find the end of an extent to verify by one CRC request,
+ * starting at the given dirty block. Clean blocks between
+ * dirty ones are included, when the file has them blank:
+ * the flash must be blank there too.
+ */
+static unsigned verify_run_end(image_t *im, unsigned addr, unsigned nbytes)
 {
-    atexit(quit);
-    target = target_open(target_port, target_speed);
-    if (! target) {
-        fprintf(stderr, _("Error detecting device -- check cable!\n"));
-        exit(1);
+    unsigned end = addr + blocksz;
+
+    for (addr=end; addr<nbytes; addr+=blocksz) {
+        if (image_is_dirty(im, addr, blocksz)) {
+            end = addr + blocksz;
+            continue;
+        }
+        if (! image_is_written(im, addr, blocksz) ||
+            ! adapter_is_blank(image_read(im, addr), blocksz))
+            break;
+    }
+    return end;
+}
+
+/*
+ * Compare the range start..end-1 with the image by CRC.
+ * On mismatch, split the range in halves to find
+ * the failing block.
+ * Return 0 on mismatch.
+ */
+static int verify_crc(target_t *mc, image_t *im, unsigned base,
+    unsigned start, unsigned end)
+{
+    unsigned mid;
+
+    if (target_get_crc(mc, base + start, end - start) ==
+        image_crc(im, 0xffff, start, end - start))
+        return 1;
+
+    while (end - start > blocksz) {
+        mid = start + (end - start) / blocksz / 2 * blocksz;
+        if (target_get_crc(mc, base + start, mid - start) !=
+            image_crc(im, 0xffff, start, mid - start))
+            end = mid;
+        else
+            start = mid;
+    }
+    printf(_("\nVerify failed at address %08X, %u bytes\n"),
+        base + start, end - start);
+    return 0;
+}
+
+/*
+ * Verify all dirty blocks of the memory region.
+ * When the adapter computes the CRC of the flash memory,
+ * one request is sent for every extent of programmed data,
+ * instead of one per block.
+ * Return 0 on mismatch.
+ */
+int verify_region(target_t *mc, image_t *im, unsigned base,
+    unsigned nbytes, unsigned step)
+{
+    unsigned addr, run_end;
+    int ok = 1;
+
+    stats_phase_begin(PHASE_VERIFY);
+    if (! target_can_compare_crc(mc)) {
+        for_each_dirty_block(addr, im, nbytes) {
+            progress(step);
+            if (! verify_block(mc, im, base, addr)) {
+                ok = 0;
+                break;
+            }
+        }
+        stats_phase_end(PHASE_VERIFY);
+        return ok;
+    }
+
+    addr = image_next_dirty(im, 0, blocksz, nbytes);
+    while (addr < nbytes) {
+        run_end = verify_run_end(im, addr, nbytes);
+        if (! verify_crc(mc, im, base, addr, run_end)) {
+            ok = 0;
+            break;
+        }
+        for (; addr < run_end; addr += blocksz)
+            if (image_is_dirty(im, addr, blocksz))
+                progress(step);
+        addr = image_next_dirty(im, run_end, blocksz, nbytes);
     }
+    stats_phase_end(PHASE_VERIFY);
+    return ok;
+}
+
+void do_erase()
+{
+    open_target();
 
     if ((target->adapter->flags & AD_ERASE) == 0) {
         fprintf(stderr, _("Error: Target erase not supported.\n"));
@@ -453,25 +883,84 @@ void do_erase()
     }
 
     target_erase(target);
+    executive_loaded = 0;
 }
 
-void do_program(char *filename)
+/*
+ * Check whether the chip is erased.
+ * Return 0 when blank, 1 otherwise.
+ */
+int do_blank_check()
 {
-    unsigned addr;
-    int progress_len, progress_step, boot_progress_len;
-    void *t0;
+    int blank;
 
-    /* Open and detect the device. */
-    atexit(quit);
-    target = target_open(target_port, target_speed);
-    if (! target) {
-        fprintf(stderr, _("Error detecting device -- check cable!\n"));
+    open_target();
+
+    if ((target->adapter->flags & AD_READ) == 0 ||
+        ! target_can_blank_check(target)) {
+        fprintf(stderr, _("Error: Blank check not supported.\n"));
         exit(1);
     }
 
+    use_executive();
+    blank = target_is_blank(target);
+    printf(_("  Blank check: %s\n"), blank ? _("blank") : _("not blank"));
+    return ! blank;
+}
+
+/*
+ * Differential mode: compare every page of the memory region
+ * with the image by CRC, and erase only pages which differ.
+ * Blocks of unchanged pages are not programmed and not verified.
+ * Return the number of changed pages.
+ */
+static unsigned diff_region(image_t *im, unsigned base, unsigned nbytes)
+{
+    unsigned pagesz = target_page_size(target);
+    unsigned addr, n, nchanged = 0, run_start = 0, run_len = 0;
+
+    for (addr=0; addr<nbytes; addr+=pagesz) {
+        n = pagesz;
+        if (addr + n > nbytes)
+            n = nbytes - addr;
+        if (target_compare_crc(target, base + addr, n, image_read(im, addr))) {
+            image_set_dirty(im, addr, n, 0);
+
+            if (run_len > 0) {
+                target_erase_pages(target, base + run_start, run_len);
+                run_len = 0;
+            }
+            continue;
+        }
+
+        /* Merge adjacent changed pages into one erase command. */
+        if (run_len == 0)
+            run_start = addr;
+        run_len++;
+        nchanged++;
+    }
+    if (run_len > 0)
+        target_erase_pages(target, base + run_start, run_len);
+    return nchanged;
+}
+
+/*
+ * Program and verify the target.
+ * Return 0 on success, 1 on error.
+ */
+int do_program(char *filename)
+{
+    unsigned addr, nblocks, devcfg_block;
+    int progress_len, progress_step, boot_progress_len;
+    int devcfg_unchanged = 0;
+    void *t0;
+
+    open_target();
+
     if ((target->adapter->flags & AD_WRITE) == 0) {
         fprintf(stderr, _("Error: Target write not supported.\n"));
-        exit(1);
+        error_reason = "write not supported";
+        return 1;
     }
 
     flash_bytes = target_flash_bytes(target);
@@ -492,40 +981,85 @@ void do_program(char *filename)
     if (boot_used) {
         if (devcfg0 == 0xffffffff) {
             fprintf(stderr, _("DEVCFG values are missing -- check your HEX file!\n"));
-            exit(1);
+            error_reason = "DEVCFG values missing";
+            return 1;
         }
         if (devcfg_offset == 0xffc0) {
             /* For MZ family, clear bits DEVSIGN0[31] and ADEVSIGN0[31]. */
-            boot_data[0xFFEF] &= 0x7f;
-            boot_data[0xFF6F] &= 0x7f;
+            unsigned char devsign = image_read(&boot_image, 0xFFEF)[0] & 0x7f;
+            unsigned char adevsign = image_read(&boot_image, 0xFF6F)[0] & 0x7f;
+
+            image_store(&boot_image, 0xFFEF, &devsign, 1);
+            image_store(&boot_image, 0xFF6F, &adevsign, 1);
         }
     }
 
-    if (! verify_only) {
-        /* Erase flash. */
-        target_erase(target);
+    if (diff_mode && ! target_can_erase_pages(target)) {
+        printf(_("Differential mode not supported by the adapter, using chip erase.\n"));
+        diff_mode = 0;
+    }
+    if (page_erase && (diff_mode || ! target_can_erase_pages(target))) {
+        if (! diff_mode)
+            printf(_("Page erase not supported by the adapter, using chip erase.\n"));
+        page_erase = 0;
     }
-    target_use_executive(target);
+    if (! verify_only && ! diff_mode && ! page_erase) {
+        /* With -k, skip erase when the chip is already blank.
+         * The check needs the PE, which has to be loaded again
+         * after chip erase, so it is done only on request. */
+        int blank = 0;
+
+        if (blank_only && target_can_blank_check(target)) {
+            use_executive();
+            blank = target_is_blank(target);
+        }
+        if (blank) {
+            printf(_("        Erase: skipped, chip is blank\n"));
+        } else {
+            /* Erase flash. */
+            target_erase(target);
 
-    /* Compute dirty bits for every block. */
-    if (flash_used) {
-        for (addr=0; addr<flash_bytes; addr+=blocksz) {
-            flash_dirty [addr / blocksz] = is_flash_block_dirty(addr);
+            /* Chip erase resets the target: load PE again. */
+            executive_loaded = 0;
         }
     }
-    if (boot_used) {
-        for (addr=0; addr<boot_bytes; addr+=blocksz) {
-            boot_dirty [addr / blocksz] = is_boot_block_dirty(addr);
+    use_executive();
+
+    /* Dirty bits are maintained by the image, except
+     * for the block which contains devcfg registers. */
+    devcfg_block = devcfg_offset / blocksz * blocksz;
+    if (boot_used)
+        image_set_dirty(&boot_image, devcfg_block, blocksz,
+            is_boot_block_dirty(devcfg_block));
+
+    if (diff_mode && ! verify_only) {
+        /* Erase only the pages which differ from the image. */
+        unsigned nchanged, devcfg_page;
+
+        nchanged = diff_region(&flash_image, FLASHP_BASE, flash_bytes);
+        printf(_("   Diff flash: %u of %u pages changed\n"), nchanged,
+            (flash_bytes + target_page_size(target) - 1) / target_page_size(target));
+        if (boot_bytes > 0) {
+            /* Remember the devcfg block state: it is not dirty unless
+             * it holds some other data. */
+            devcfg_page = image_is_dirty(&boot_image, devcfg_block, blocksz);
+            image_set_dirty(&boot_image, devcfg_block, blocksz, 1);
+            nchanged = diff_region(&boot_image, BOOTP_BASE, boot_bytes);
+            printf(_("    Diff boot: %u of %u pages changed\n"), nchanged,
+                (boot_bytes + target_page_size(target) - 1) / target_page_size(target));
+            if (! image_is_dirty(&boot_image, devcfg_block, blocksz))
+                devcfg_unchanged = 1;
+            else
+                image_set_dirty(&boot_image, devcfg_block, blocksz, devcfg_page);
         }
     }
 
     /* Compute length of progress indicator for flash memory. */
+    nblocks = 0;
+    for_each_dirty_block(addr, &flash_image, flash_bytes)
+        nblocks++;
     for (progress_step=1; ; progress_step<<=1) {
-        progress_len = 0;
-        for (addr=0; addr<flash_bytes; addr+=blocksz) {
-            if (flash_dirty [addr / blocksz])
-                progress_len++;
-        }
+        progress_len = nblocks;
         if (progress_len / progress_step < 64) {
             progress_len /= progress_step;
             if (progress_len < 1)
@@ -536,10 +1070,8 @@ void do_program(char *filename)
 
     /* Compute length of progress indicator for boot memory. */
     boot_progress_len = 1;
-    for (addr=0; addr<boot_bytes; addr+=blocksz) {
-        if (boot_dirty [addr / blocksz])
-            boot_progress_len++;
-    }
+    for_each_dirty_block(addr, &boot_image, boot_bytes)
+        boot_progress_len++;
 
     progress_count = 0;
     t0 = fix_time();
@@ -549,12 +1081,9 @@ void do_program(char *filename)
             print_symbols('.', progress_len);
             print_symbols('\b', progress_len);
             fflush(stdout);
-            for (addr=0; addr<flash_bytes; addr+=blocksz) {
-                if (flash_dirty [addr / blocksz]) {
-                    program_block(target, addr + (flashv_kseg ? FLASHV_KSEG1_BASE : FLASHV_KSEG0_BASE));
-                    progress(progress_step);
-                }
-            }
+            program_region(target, &flash_image,
+                flashv_kseg ? FLASHV_KSEG1_BASE : FLASHV_KSEG0_BASE,
+                flash_bytes, progress_step);
             printf(_("# done\n"));
         }
         if (boot_used) {
@@ -562,18 +1091,15 @@ void do_program(char *filename)
             print_symbols('.', boot_progress_len);
             print_symbols('\b', boot_progress_len);
             fflush(stdout);
-            for (addr=0; addr<boot_bytes; addr+=blocksz) {
-                if (boot_dirty [addr / blocksz]) {
-                    program_block(target, addr + (bootv_kseg ? BOOTV_KSEG1_BASE : BOOTV_KSEG0_BASE));
-                    progress(1);
-                }
-            }
+            program_region(target, &boot_image,
+                bootv_kseg ? BOOTV_KSEG1_BASE : BOOTV_KSEG0_BASE,
+                boot_bytes, 1);
             printf(_("# done      \n"));
-            if (! boot_dirty [devcfg_offset / blocksz]) {
+            if (! image_is_dirty(&boot_image, devcfg_block, blocksz) && ! devcfg_unchanged) {
                 /* Write chip configuration. */
                 target_program_devcfg(target,
                     devcfg0, devcfg1, devcfg2, devcfg3);
-                boot_dirty [devcfg_offset / blocksz] = 1;
+                image_set_dirty(&boot_image, devcfg_block, blocksz, 1);
             }
         }
     }
@@ -582,12 +1108,11 @@ void do_program(char *filename)
         print_symbols('.', progress_len);
         print_symbols('\b', progress_len);
         fflush(stdout);
-        for (addr=0; addr<flash_bytes; addr+=blocksz) {
-            if (flash_dirty [addr / blocksz]) {
-                progress(progress_step);
-                if (! verify_block(target, addr + (flashv_kseg ? FLASHV_KSEG1_BASE : FLASHV_KSEG0_BASE)))
-                    exit(0);
-            }
+        if (! verify_region(target, &flash_image,
+                flashv_kseg ? FLASHV_KSEG1_BASE : FLASHV_KSEG0_BASE,
+                flash_bytes, progress_step)) {
+            error_reason = "flash verify failed";
+            return 1;
         }
         printf(_(" done\n"));
     }
@@ -596,50 +1121,237 @@ void do_program(char *filename)
         print_symbols('.', boot_progress_len);
         print_symbols('\b', boot_progress_len);
         fflush(stdout);
-        for (addr=0; addr<boot_bytes; addr+=blocksz) {
-            if (boot_dirty [addr / blocksz]) {
-                progress(1);
-                if (! verify_block(target, addr + (bootv_kseg ? BOOTV_KSEG1_BASE : BOOTV_KSEG0_BASE)))
-                    exit(0);
-            }
+        if (! verify_region(target, &boot_image,
+                bootv_kseg ? BOOTV_KSEG1_BASE : BOOTV_KSEG0_BASE,
+                boot_bytes, 1)) {
+            error_reason = "boot verify failed";
+            return 1;
         }
         printf(_(" done       \n"));
     }
     if (boot_used || flash_used)
         printf(_(" Program rate: %ld bytes per second\n"),
             total_bytes * 1000L / mseconds_elapsed(t0));
+    return 0;
 }
 
-void do_read(char *filename, unsigned base, unsigned nbytes)
+/*
+ * Gang mode: program several targets in parallel.
+ * The image is parsed once. Every target is served by a separate
+ * worker process, which inherits the image read-only and has its own
+ * copy of the programming state. Output of the workers is collected
+ * and prefixed with the target number.
+ */
+void do_gang(char *filename)
+{
+#ifdef MINGW32
+    fprintf(stderr, _("Gang programming is not supported on this platform.\n"));
+    exit(1);
+#else
+    pid_t pid [MAXGANG];
+    int fd [MAXGANG], len [MAXGANG], ok [MAXGANG];
+    unsigned msec [MAXGANG], elapsed;
+    char line [MAXGANG][256], buf [256];
+    int i, k, n, nopen, maxfd, nok, status;
+    fd_set rset;
+    void *t0;
+
+    /* Parse the configuration file once, before forking workers. */
+    target_configure();
+
+    fflush(stdout);
+    fflush(stderr);
+    t0 = fix_time();
+    for (i=0; i<gang_count; i++) {
+        int p[2];
+
+        if (pipe(p) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+        pid[i] = fork();
+        if (pid[i] < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid[i] == 0) {
+            /* Worker: program one target. */
+            for (k=0; k<i; k++)
+                close(fd[k]);
+            close(p[0]);
+            dup2(p[1], 1);
+            dup2(p[1], 2);
+            close(p[1]);
+            target_port = gang_port[i];
+            gang_index = i + 1;
+            status = do_program(filename);
+            quit();
+            exit(status);
+        }
+        close(p[1]);
+        fd[i] = p[0];
+        len[i] = 0;
+    }
+
+    /* Collect output of workers, line by line. */
+    for (nopen=gang_count; nopen>0; ) {
+        FD_ZERO(&rset);
+        maxfd = 0;
+        for (i=0; i<gang_count; i++) {
+            if (fd[i] < 0)
+                continue;
+            FD_SET(fd[i], &rset);
+            if (fd[i] > maxfd)
+                maxfd = fd[i];
+        }
+        if (select(maxfd + 1, &rset, 0, 0, 0) < 0) {
+            perror("select");
+            exit(1);
+        }
+        for (i=0; i<gang_count; i++) {
+            if (fd[i] < 0 || ! FD_ISSET(fd[i], &rset))
+                continue;
+            n = read(fd[i], buf, sizeof(buf));
+            if (n <= 0) {
+                /* Worker finished. */
+                if (len[i] > 0)
+                    printf("[%d] %.*s\n", i+1, len[i], line[i]);
+                close(fd[i]);
+                fd[i] = -1;
+                msec[i] = mseconds_elapsed(t0);
+                nopen--;
+                continue;
+            }
+            for (k=0; k<n; k++) {
+                if (buf[k] != '\n' && len[i] < sizeof(line[i]))
+                    line[i][len[i]++] = buf[k];
+                if (buf[k] == '\n' || len[i] == sizeof(line[i])) {
+                    printf("[%d] %.*s\n", i+1, len[i], line[i]);
+                    len[i] = 0;
+                }
+            }
+        }
+    }
+    elapsed = mseconds_elapsed(t0);
+
+    /* Get results. */
+    nok = 0;
+    for (i=0; i<gang_count; i++) {
+        ok[i] = (waitpid(pid[i], &status, 0) == pid[i] &&
+                 WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        nok += ok[i];
+    }
+    printf("\n");
+    for (i=0; i<gang_count; i++) {
+        printf(_("    Target %d: %s, %s, %u.%03u seconds\n"), i+1,
+            gang_port[i], ok[i] ? _("done") : _("FAILED"),
+            msec[i] / 1000, msec[i] % 1000);
+    }
+    printf(_("  Gang result: %d of %d targets programmed\n"), nok, gang_count);
+    if (nok > 0)
+        printf(_("   Total rate: %ld bytes per second\n"),
+            total_bytes * 1000L * nok / elapsed);
+    if (nok != gang_count)
+        exit(1);
+#endif
+}
+
+/*
+ * Write one Intel HEX record.
+ */
+static void write_hex_record(FILE *fd, unsigned type, unsigned addr,
+    const unsigned char *data, unsigned len)
+{
+    unsigned i, sum;
+
+    fprintf(fd, ":%02X%04X%02X", len, addr & 0xffff, type);
+    sum = len + (addr >> 8 & 0xff) + (addr & 0xff) + type;
+    for (i=0; i<len; i++) {
+        fprintf(fd, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(fd, "%02X\n", -sum & 0xff);
+}
+
+/*
+ * Write a piece of memory contents in Intel HEX format,
+ * using physical addresses.
+ * The upper address of the last record is kept in *high,
+ * which must be set to ~0 at the start of a file.
+ */
+static void write_hex(FILE *fd, unsigned addr,
+    const unsigned char *data, unsigned nbytes, unsigned *high)
+{
+    unsigned char seg [2];
+    unsigned n;
+
+    addr &= 0x1fffffff;
+    while (nbytes > 0) {
+        if (*high != addr >> 16) {
+            /* Extended linear address record. */
+            *high = addr >> 16;
+            seg[0] = *high >> 8;
+            seg[1] = *high;
+            write_hex_record(fd, 4, 0, seg, 2);
+        }
+        n = 16 - addr % 16;
+        if (n > nbytes)
+            n = nbytes;
+        write_hex_record(fd, 0, addr, data, n);
+        addr += n;
+        data += n;
+        nbytes -= n;
+    }
+}
+
+/*
+ * Read memory to a file: in Intel HEX format when the name
+ * ends with .hex, otherwise raw binary.
+ * Return 0 on success, 1 on error.
+ */
+int do_read(char *filename, unsigned base, unsigned nbytes)
 {
     FILE *fd;
-    unsigned len, addr, data [256], progress_step;
+    unsigned len, addr, n, progress_step, chunk_words, hex_high;
+    unsigned *data;
+    int hex_format;
     void *t0;
 
-    fd = fopen(filename, "wb");
+    len = strlen(filename);
+    hex_format = (len > 4 && strcasecmp(filename + len - 4, ".hex") == 0);
+    fd = fopen(filename, hex_format ? "w" : "wb");
     if (! fd) {
         perror(filename);
-        exit(1);
+        error_reason = "cannot create file";
+        return 1;
     }
     printf(_("       Memory: total %d bytes\n"), nbytes);
 
-    /* Use 1kbyte blocks. */
-    blocksz = 1024;
-
-    /* Open and detect the device. */
-    atexit(quit);
-    target = target_open(target_port, target_speed);
-    if (! target) {
-        fprintf(stderr, _("Error detecting device -- check cable!\n"));
+    /* Read in big chunks, and write each chunk at once. */
+    if (read_chunk < 1024)
+        read_chunk = 1024;
+    chunk_words = read_chunk / 4;
+    data = malloc(chunk_words * 4);
+    if (! data) {
+        fprintf(stderr, _("Out of memory\n"));
         exit(1);
     }
+    setvbuf(fd, 0, _IOFBF, hex_format ? 4 * read_chunk : read_chunk);
+
+    open_target();
 
     if ((target->adapter->flags & AD_READ) == 0) {
         fprintf(stderr, _("Error: Target read not supported.\n"));
-        exit(1);
+        fclose(fd);
+        free(data);
+        error_reason = "read not supported";
+        return 1;
     }
 
-    target_use_executive(target);
+    use_executive();
+
+    /* Progress is counted in 1-kbyte blocks. */
+    blocksz = 1024;
     for (progress_step=1; ; progress_step<<=1) {
         len = 1 + nbytes / progress_step / blocksz;
         if (len < 64)
@@ -651,19 +1363,263 @@ void do_read(char *filename, unsigned base, unsigned nbytes)
     fflush(stdout);
 
     progress_count = 0;
+    hex_high = ~0;
     t0 = fix_time();
-    for (addr=base; addr-base<nbytes; addr+=blocksz) {
-        progress(progress_step);
-        target_read_block(target, addr, blocksz/4, data);
-        if (fwrite(data, 1, blocksz, fd) != blocksz) {
+    stats_phase_begin(PHASE_READ);
+    nbytes = (nbytes + 3) & ~3;
+    for (addr=base; addr-base<nbytes; addr+=n) {
+        n = nbytes - (addr - base);
+        if (n > chunk_words * 4)
+            n = chunk_words * 4;
+
+        /* Adapters read by blocks: round up the last chunk. */
+        target_read_block(target, addr, ((n + 1023) & ~1023) / 4, data);
+        for (len=0; len<n; len+=blocksz)
+            progress(progress_step);
+
+        if (hex_format)
+            write_hex(fd, addr, (unsigned char*) data, n, &hex_high);
+        else if (fwrite(data, 1, n, fd) != n) {
             fprintf(stderr, "%s: write error!\n", filename);
-            exit(1);
+            fclose(fd);
+            free(data);
+            error_reason = "file write error";
+            return 1;
         }
     }
+    stats_phase_end(PHASE_READ);
+    if (hex_format)
+        write_hex_record(fd, 1, 0, 0, 0);
+    free(data);
+    if (fclose(fd) != 0) {
+        fprintf(stderr, "%s: write error!\n", filename);
+        error_reason = "file write error";
+        return 1;
+    }
     printf(_("# done\n"));
     printf(_("         Rate: %ld bytes per second\n"),
         nbytes * 1000L / mseconds_elapsed(t0));
-    fclose(fd);
+    return 0;
+}
+
+#ifndef MINGW32
+/*
+ * Execute one command of the server.
+ * Return 0 on success, 1 on error, -1 to stop the server.
+ */
+static int server_command(char *line)
+{
+    char *argv [8];
+    int argc;
+    unsigned addr, data [256];
+
+    for (argc=0; argc<8; argc++) {
+        argv[argc] = strtok(argc ? 0 : line, " \t\r\n");
+        if (! argv[argc])
+            break;
+    }
+    error_reason = "bad command";
+    if (argc == 0)
+        return 1;
+
+    if (strcmp(argv[0], "program") == 0 && argc == 2) {
+        reset_image();
+        if (read_file(argv[1]) < 0)
+            return 1;
+        verify_only = 0;
+        return do_program(argv[1]);
+    }
+    if (strcmp(argv[0], "verify") == 0 && argc == 2) {
+        int status;
+
+        reset_image();
+        if (read_file(argv[1]) < 0)
+            return 1;
+        verify_only = 1;
+        status = do_program(argv[1]);
+        verify_only = 0;
+        return status;
+    }
+    if (strcmp(argv[0], "read") == 0 && argc == 4) {
+        return do_read(argv[1], strtoul(argv[2], 0, 0), strtoul(argv[3], 0, 0));
+    }
+    if (strcmp(argv[0], "word") == 0 && argc == 2) {
+        /* Read the whole 1-kbyte block, using PE. */
+        addr = strtoul(argv[1], 0, 0) & ~3;
+        use_executive();
+        target_read_block(target, addr & ~1023, 256, data);
+        printf("%08x\n", data [(addr & 1023) / 4]);
+        return 0;
+    }
+    if (strcmp(argv[0], "quit") == 0)
+        return -1;
+
+    printf(_("Unknown command: %s\n"), argv[0]);
+    printf(_("Commands: program FILE, verify FILE, read FILE ADDR LEN, word ADDR, quit\n"));
+    return 1;
+}
+#endif
+
+/*
+ * Server mode: keep the target open and the PE running,
+ * and execute commands from clients on a local socket.
+ * Every connection carries one command line; the output
+ * is sent back, followed by a status line "=ok" or "=error reason".
+ * Failures of a command, like a bad file or verify mismatch,
+ * don't stop the server.
+ */
+void do_server(const char *path)
+{
+#ifdef MINGW32
+    fprintf(stderr, _("Server mode is not supported on this platform.\n"));
+    exit(1);
+#else
+    struct sockaddr_un addr;
+    char line [1024];
+    int sock, conn, n, len, status, saved_stdout, saved_stderr;
+
+    open_target();
+    use_executive();
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(sock, 4) < 0) {
+        perror(path);
+        exit(1);
+    }
+    printf(_("       Server: %s, waiting for commands\n"), path);
+    signal(SIGPIPE, SIG_IGN);
+    saved_stdout = dup(1);
+    saved_stderr = dup(2);
+
+    for (;;) {
+        conn = accept(sock, 0, 0);
+        if (conn < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            break;
+        }
+
+        /* Get command line. */
+        for (len=0; len<sizeof(line)-1; len+=n) {
+            n = read(conn, line + len, sizeof(line) - 1 - len);
+            if (n <= 0 || memchr(line + len, '\n', n)) {
+                if (n > 0)
+                    len += n;
+                break;
+            }
+        }
+        line[len] = 0;
+
+        /* Send output to the client. */
+        fflush(stdout);
+        fflush(stderr);
+        dup2(conn, 1);
+        dup2(conn, 2);
+        status = server_command(line);
+        fflush(stdout);
+        fflush(stderr);
+        if (status > 0)
+            printf("=error %s\n", error_reason);
+        else
+            printf("=ok\n");
+        fflush(stdout);
+        dup2(saved_stdout, 1);
+        dup2(saved_stderr, 2);
+        close(conn);
+        if (status < 0)
+            break;
+    }
+    close(sock);
+    unlink(path);
+#endif
+}
+
+/*
+ * Client mode: send a command to the server and print the reply.
+ * File names are converted to absolute paths.
+ * Return 0 on success.
+ */
+int do_client(const char *path, int argc, char **argv)
+{
+#ifdef MINGW32
+    fprintf(stderr, _("Client mode is not supported on this platform.\n"));
+    return 1;
+#else
+    struct sockaddr_un addr;
+    char line [1024], cwd [512], buf [256];
+    int sock, i, n, len, at_bol = 1, in_status = 0, status = 1;
+
+    if (argc < 1) {
+        fprintf(stderr, _("No command for server\n"));
+        return 1;
+    }
+    if (! getcwd(cwd, sizeof(cwd)))
+        strcpy(cwd, ".");
+    len = 0;
+    for (i=0; i<argc; i++) {
+        /* Argument after program, verify or read is a file name. */
+        int is_file = (i == 1 && strcmp(argv[0], "word") != 0 &&
+            argv[1][0] != '/');
+
+        len += snprintf(line + len, sizeof(line) - len, "%s%s%s%s",
+            i ? " " : "", is_file ? cwd : "", is_file ? "/" : "", argv[i]);
+        if (len >= sizeof(line) - 1) {
+            fprintf(stderr, _("Command too long\n"));
+            return 1;
+        }
+    }
+    line[len++] = '\n';
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror(path);
+        return 1;
+    }
+    if (write(sock, line, len) != len) {
+        perror(path);
+        return 1;
+    }
+
+    /* Copy the reply to stdout, and get the status line. */
+    len = 0;
+    while ((n = read(sock, buf, sizeof(buf))) > 0) {
+        for (i=0; i<n; i++) {
+            if (at_bol && buf[i] == '=') {
+                in_status = 1;
+                len = 0;
+            } else if (in_status) {
+                if (buf[i] == '\n') {
+                    line[len] = 0;
+                    status = (strcmp(line, "ok") != 0);
+                    if (status)
+                        fprintf(stderr, _("Server: %s\n"), line);
+                    in_status = 0;
+                } else if (len < sizeof(line) - 1) {
+                    line[len++] = buf[i];
+                }
+            } else {
+                putchar(buf[i]);
+            }
+            at_bol = (buf[i] == '\n');
+        }
+        fflush(stdout);
+    }
+    close(sock);
+    return status;
+#endif
 }
 
 /*
@@ -712,16 +1668,32 @@ static void gpl_show_warranty(void)
     printf("\n");
 }
 
+/* Long-only options. */
+#define OPT_STATS       0x100
+#define OPT_TRACE       0x101
+
 int main(int argc, char **argv)
 {
     int ch, read_mode = 0;
     unsigned base, nbytes;
+    const char *server_path = 0, *client_path = 0;
+    const char *trace_path = 0;
+    int stats_flag = 0;
     static const struct option long_options[] = {
         { "help",        0, 0, 'h' },
         { "warranty",    0, 0, 'W' },
         { "copying",     0, 0, 'C' },
         { "version",     0, 0, 'V' },
         { "skip-verify", 0, 0, 'S' },
+        { "diff",        0, 0, 'F' },
+        { "page-erase",  0, 0, 'P' },
+        { "blank-check", 0, 0, 'k' },
+        { "server",      1, 0, 'L' },
+        { "read-chunk",  1, 0, 'z' },
+        { "jtag-clock",  1, 0, 'J' },
+        { "client",      1, 0, 'c' },
+        { "stats",       0, 0, OPT_STATS },
+        { "trace",       1, 0, OPT_TRACE },
         { NULL,          0, 0, 0 },
     };
 
@@ -750,7 +1722,7 @@ int main(int argc, char **argv)
 #endif
     signal(SIGTERM, interrupted);
 
-    while ((ch = getopt_long(argc, argv, "vDhrpeCVWSd:b:B:",
+    while ((ch = getopt_long(argc, argv, "vDhrpekCVWSFPd:b:B:L:c:z:J:",
       long_options, 0)) != -1) {
         switch (ch) {
         case 'v':
@@ -768,8 +1740,38 @@ int main(int argc, char **argv)
         case 'e':
             ++erase_only;
             continue;
+        case 'k':
+            ++blank_only;
+            continue;
+        case 'J':
+            if (strcmp(optarg, "auto") == 0)
+                jtag_khz = -1;
+            else
+                jtag_khz = strtoul(optarg, 0, 0);
+            continue;
+        case 'z':
+            read_chunk = strtoul(optarg, 0, 0) & ~1023;
+            continue;
+        case 'L':
+            server_path = optarg;
+            continue;
+        case 'c':
+            client_path = optarg;
+            continue;
+        case OPT_STATS:
+            ++stats_flag;
+            continue;
+        case OPT_TRACE:
+            trace_path = optarg;
+            continue;
         case 'd':
-            target_port = optarg;
+            if (gang_count >= MAXGANG) {
+                fprintf(stderr, _("Too many devices, max %d\n"), MAXGANG);
+                return 0;
+            }
+            gang_port[gang_count++] = optarg;
+            if (! target_port)
+                target_port = optarg;
             continue;
         case 'b':
             target_speed = strtoul(optarg, 0, 0);
@@ -783,6 +1785,11 @@ int main(int argc, char **argv)
             }
             continue;
         case 'B':
+            if (strcmp(optarg, "auto") == 0) {
+                /* Negotiate the fastest rate. */
+                alternate_speed = 0;
+                continue;
+            }
             alternate_speed = strtoul(optarg, 0, 0);
             if (! serial_speed_valid(alternate_speed)) {
                 printf("Debug: %d\n", alternate_speed);
@@ -803,6 +1810,12 @@ int main(int argc, char **argv)
         case 'S':
             ++skip_verify;
             continue;
+        case 'F':
+            ++diff_mode;
+            continue;
+        case 'P':
+            ++page_erase;
+            continue;
         }
 usage:
         printf("%s.\n\n", copyright);
@@ -815,18 +1828,31 @@ usage:
         printf("\nWrite flash memory:\n");
         printf("       pic32prog [-v] file.srec\n");
         printf("       pic32prog [-v] file.hex\n");
+        printf("       pic32prog [-v] file.elf\n");
         printf("\nRead memory:\n");
         printf("       pic32prog -r file.bin address length\n");
+        printf("       pic32prog -r file.hex address length\n");
+        printf("\nServer mode, keep the target open:\n");
+        printf("       pic32prog -L socket\n");
+        printf("       pic32prog -c socket program file.hex\n");
+        printf("       pic32prog -c socket verify file.hex\n");
+        printf("       pic32prog -c socket read file.bin address length\n");
+        printf("       pic32prog -c socket word address\n");
+        printf("       pic32prog -c socket quit\n");
         printf("\nArgs:\n");
         printf("       file.srec           Code file in SREC format\n");
         printf("       file.hex            Code file in Intel HEX format\n");
+        printf("       file.elf            Code file in ELF format\n");
         printf("       file.bin            Code file in binary format\n");
         printf("       -v                  Verify only\n");
         printf("       -r                  Read mode\n");
-        printf("       -d device           Use specified serial or USB device\n");
+        printf("       -d device           Use specified serial or USB device;\n");
+        printf("                           repeat to program several targets in parallel\n");
         printf("       -b baudrate         Serial speed, default 115200\n");
-        printf("       -B alt_baud         Request an alternative baud rate\n");
+        printf("       -B alt_baud         Request an alternative baud rate, or 'auto'\n");
         printf("       -e                  Erase chip\n");
+        printf("       -k, --blank-check   Check that chip is erased;\n");
+        printf("                           with a file, skip erase of a blank chip\n");
         printf("       -p                  Leave board powered on\n");
         printf("       -D                  Debug mode\n");
         printf("       -h, --help          Print this help message\n");
@@ -834,38 +1860,65 @@ usage:
         printf("       -C, --copying       Print copying information\n");
         printf("       -W, --warranty      Print warranty information\n");
         printf("       -S, --skip-verify   Skip the write verification step\n");
+        printf("       -J, --jtag-clock khz TCK rate for MPSSE adapters, or 'auto'\n");
+        printf("       -z, --read-chunk N  Read memory in chunks of N bytes, default 65536\n");
+        printf("       -L, --server socket Run as server on a local socket\n");
+        printf("       -c, --client socket Send a command to the server\n");
+        printf("       -F, --diff          Rewrite only the pages which differ\n");
+        printf("       -P, --page-erase    Erase only the pages used by the file\n");
+        printf("       --stats             Print timing statistics per phase and transaction\n");
+        printf("       --trace=file        Write a log of all transactions to file\n");
         printf("\n");
         return 0;
     }
-    printf("%s\n", copyright);
     argc -= optind;
     argv += optind;
+    if (client_path)
+        return do_client(client_path, argc, argv);
+    if (stats_flag || trace_path)
+        stats_enable(stats_flag, trace_path);
+    printf("%s\n", copyright);
 
-    memset(boot_data, ~0, BOOT_BYTES);
-    memset(flash_data, ~0, FLASH_BYTES);
+    image_init(&boot_image, BOOT_BYTES);
+    image_init(&flash_image, FLASH_BYTES);
+
+    if (server_path) {
+        do_server(server_path);
+        quit();
+        return 0;
+    }
 
     switch (argc) {
     case 0:
         if (erase_only > 0) {
             do_erase();
+        } else if (blank_only > 0) {
+            if (do_blank_check() != 0) {
+                quit();
+                return 1;
+            }
         } else {
             do_probe();
         }
         break;
     case 1:
-        if (! read_srec(argv[0]) &&
-            ! read_hex(argv[0])) {
-            fprintf(stderr, _("%s: bad file format\n"), argv[0]);
-            exit(1);
+        if (gang_count > 1) {
+            if (read_file(argv[0]) < 0)
+                exit(1);
+            do_gang(argv[0]);
+        } else {
+            open_target_and_read_file(argv[0]);
+            if (do_program(argv[0]) != 0)
+                exit(1);
         }
-        do_program(argv[0]);
         break;
     case 3:
         if (! read_mode)
             goto usage;
         base = strtoul(argv[1], 0, 0);
         nbytes = strtoul(argv[2], 0, 0);
-        do_read(argv[0], base, nbytes);
+        if (do_read(argv[0], base, nbytes) != 0)
+            exit(1);
         break;
     default:
         goto usage;
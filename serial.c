@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include "adapter.h"
+#include "stats.h"
 
 #if defined(__WIN32__) || defined(WIN32)
     #include <windows.h>
@@ -26,6 +27,26 @@
     static struct termios saved_mode;
 #endif
 
+#ifdef __linux__
+    #include <limits.h>
+    #include <sys/ioctl.h>
+    #include <linux/serial.h>
+#endif
+
+/*
+ * Output is collected in the transmit buffer, to send
+ * many small writes by one system call.
+ * Input is read in big portions into the receive buffer,
+ * valid data are rxbuf[rxhead...rxtail-1].
+ */
+#define TXBUF_SIZE      4096
+#define RXBUF_SIZE      4096
+
+static unsigned char txbuf [TXBUF_SIZE];
+static int txlen;
+static unsigned char rxbuf [RXBUF_SIZE];
+static int rxhead, rxtail;
+
 /*
  * Encode the speed in bits per second into bit value
  * accepted by cfsetspeed() function.
@@ -143,28 +164,89 @@ int serial_speed_valid(int bps)
 }
 
 /*
- * Send data to device.
- * Return number of bytes, or -1 on error.
+ * Send the buffered output to device.
+ * Return -1 on error.
  */
-int serial_write(unsigned char *data, int len)
+int serial_flush()
 {
+    unsigned long long t0;
+    unsigned char *p = txbuf;
+    int n;
+
+    if (txlen == 0)
+        return 0;
+    t0 = stats_time();
+    while (txlen > 0) {
 #if defined(__WIN32__) || defined(WIN32)
-    DWORD written;
+        DWORD written;
 
-    if (! WriteFile(fd, data, len, &written, 0))
-        return -1;
-    return written;
+        if (! WriteFile(fd, p, txlen, &written, 0)) {
+            txlen = 0;
+            return -1;
+        }
+        n = written;
 #else
-    return write(fd, data, len);
+        n = write(fd, p, txlen);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            txlen = 0;
+            return -1;
+        }
 #endif
+        p += n;
+        txlen -= n;
+    }
+    stats_event(STAT_SERIAL_OUT, p - txbuf, t0);
+    return 0;
+}
+
+/*
+ * Send data to device.
+ * The data are buffered, and sent when the buffer is full,
+ * before the next read, or by serial_flush().
+ * Return number of bytes, or -1 on error.
+ */
+int serial_write(unsigned char *data, int len)
+{
+    int n, nbytes = len;
+
+    while (len > 0) {
+        n = TXBUF_SIZE - txlen;
+        if (n > len)
+            n = len;
+        memcpy(txbuf + txlen, data, n);
+        txlen += n;
+        data += n;
+        len -= n;
+        if (txlen == TXBUF_SIZE && serial_flush() < 0)
+            return -1;
+    }
+    return nbytes;
 }
 
 /*
  * Receive data from device.
+ * Pending output is sent first.
+ * Everything available is read into the receive buffer
+ * by one system call, and returned by this and the next calls.
  * Return number of bytes, or -1 on error.
  */
 int serial_read(unsigned char *data, int len, int timeout_msec)
 {
+    unsigned long long t0;
+
+    if (serial_flush() < 0)
+        return -1;
+    if (rxhead < rxtail) {
+        /* Get data from the receive buffer. */
+        if (len > rxtail - rxhead)
+            len = rxtail - rxhead;
+        memcpy(data, rxbuf + rxhead, len);
+        rxhead += len;
+        return len;
+    }
+    t0 = stats_time();
 #if defined(__WIN32__) || defined(WIN32)
     DWORD got;
     COMMTIMEOUTS ctmo;
@@ -211,28 +293,120 @@ again:
     if (got == 0) {
         if (debug_level > 1)
             printf("serial_read: no characters to read\n");
+        stats_event(STAT_SERIAL_IN, 0, t0);
         return 0;
     }
 
 #if ! defined(__WIN32__) && ! defined(WIN32)
-    got = read(fd, data, (len > 1024) ? 1024 : len);
+    got = read(fd, rxbuf, RXBUF_SIZE);
     if (got < 0) {
         fprintf(stderr, "serial_read: read error\n");
         exit(-1);
     }
-#endif
+    stats_event(STAT_SERIAL_IN, got, t0);
+    rxhead = 0;
+    rxtail = got;
+    if (len > got)
+        len = got;
+    memcpy(data, rxbuf, len);
+    rxhead = len;
+    return len;
+#else
+    stats_event(STAT_SERIAL_IN, got, t0);
     return got;
+#endif
 }
 
+#ifdef __linux__
+/*
+ * Previous latency settings of the port, restored on close.
+ */
+static int saved_flags = -1;
+static int saved_latency = -1;
+static char latency_path [PATH_MAX + 64];
+
+/*
+ * Minimize the receive latency of the port.
+ * FTDI chips hold received data up to 16 msec by default:
+ * set the latency timer to 1 msec, when permitted.
+ * The settings persist in the driver, so the old values
+ * are saved here and restored by serial_restore_latency().
+ */
+static void serial_low_latency(const char *devname)
+{
+    struct serial_struct ss;
+    char path [PATH_MAX];
+    FILE *f;
+
+    if (ioctl(fd, TIOCGSERIAL, &ss) == 0 &&
+        ! (ss.flags & ASYNC_LOW_LATENCY)) {
+        saved_flags = ss.flags;
+        ss.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(fd, TIOCSSERIAL, &ss) < 0)
+            saved_flags = -1;
+    }
+
+    if (! realpath(devname, path))
+        return;
+    snprintf(latency_path, sizeof(latency_path),
+        "/sys/bus/usb-serial/devices/%s/latency_timer",
+        strrchr(path, '/') + 1);
+    f = fopen(latency_path, "r+");
+    if (! f) {
+        if (debug_level > 0 && access(latency_path, F_OK) == 0)
+            fprintf(stderr, "%s: cannot set latency timer\n", latency_path);
+        return;
+    }
+    if (fscanf(f, "%d", &saved_latency) != 1 || saved_latency == 1) {
+        saved_latency = -1;
+    } else {
+        rewind(f);
+        fprintf(f, "1\n");
+    }
+    if (fclose(f) != 0)
+        saved_latency = -1;
+}
+
+/*
+ * Put back the latency settings changed by serial_low_latency().
+ */
+static void serial_restore_latency()
+{
+    struct serial_struct ss;
+    FILE *f;
+
+    if (saved_flags >= 0 && ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+        ss.flags = (ss.flags & ~ASYNC_LOW_LATENCY) |
+            (saved_flags & ASYNC_LOW_LATENCY);
+        ioctl(fd, TIOCSSERIAL, &ss);
+    }
+    saved_flags = -1;
+
+    if (saved_latency >= 0) {
+        f = fopen(latency_path, "w");
+        if (f) {
+            fprintf(f, "%d\n", saved_latency);
+            fclose(f);
+        }
+    }
+    saved_latency = -1;
+}
+#endif
+
 /*
  * Close the serial port.
  */
 void serial_close()
 {
+    serial_flush();
+    rxhead = rxtail = 0;
 #if defined(__WIN32__) || defined(WIN32)
     SetCommState(fd, &saved_mode);
     CloseHandle(fd);
 #else
+#ifdef __linux__
+    serial_restore_latency();
+#endif
     tcsetattr(fd, TCSANOW, &saved_mode);
     close(fd);
 #endif
@@ -337,7 +511,12 @@ int serial_open(const char *devname, int baud_rate)
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags >= 0)
         fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+#ifdef __linux__
+    serial_low_latency(devname);
+#endif
 #endif
+    txlen = 0;
+    rxhead = rxtail = 0;
     return 0;
 }
 
@@ -353,6 +532,8 @@ int serial_baud(int baud_rate)
     struct termios new_mode;
 #endif
 
+    /* Send pending data at the old rate. */
+    serial_flush();
 #if defined(__WIN32__) || defined(WIN32)
     new_mode = saved_mode;
 
@@ -391,6 +572,7 @@ int serial_baud(int baud_rate)
     new_mode.c_cc[VMIN]  = 1;
     cfsetispeed(&new_mode, baud_code);
     cfsetospeed(&new_mode, baud_code);
+    tcdrain(fd);
     tcflush(fd, TCIFLUSH);
     tcsetattr(fd, TCSANOW, &new_mode);
 
@@ -399,5 +581,6 @@ int serial_baud(int baud_rate)
     if (flags >= 0)
         fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
 #endif
+    rxhead = rxtail = 0;
     return 0;
 }
@@ -31,12 +31,21 @@ void serial_close(void);
 
 /*
  * Send data to device.
+ * Output is buffered: it is sent when the buffer is full,
+ * before the next serial_read(), or by serial_flush().
  * Return number of bytes, or -1 on error.
  */
 int serial_write(unsigned char *data, int len);
 
+/*
+ * Send the buffered output.
+ * Return -1 on error.
+ */
+int serial_flush(void);
+
 /*
  * Receive data from device.
+ * Pending output is sent first.
  * Return number of bytes, or -1 on error.
  */
 int serial_read(unsigned char *data, int len, int timeout_msec);
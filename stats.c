@@ -0,0 +1,173 @@
+/*
+ * Timing statistics and trace of adapter transactions.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "stats.h"
+
+extern int gang_index;
+
+int stats_enabled;
+
+static int report_enabled;
+static const char *trace_filename;
+static FILE *trace_file;
+static unsigned long long time_base;
+
+static struct {
+    unsigned            count;
+    unsigned long long  nbytes;
+    unsigned long long  usec;
+} event [STAT_NEVENTS];
+
+static struct {
+    unsigned            count;
+    unsigned long long  start;
+    unsigned long long  usec;
+} phase [STAT_NPHASES];
+
+static const char *event_name [STAT_NEVENTS] = {
+    "usb-out", "usb-in", "serial-out", "serial-in", "pracc-poll", "command",
+};
+
+static const char *phase_name [STAT_NPHASES] = {
+    "parse", "open", "erase", "pe-load", "program", "verify", "read",
+};
+
+static unsigned long long current_time()
+{
+    struct timeval t;
+
+    gettimeofday(&t, 0);
+    return t.tv_sec * 1000000ULL + t.tv_usec;
+}
+
+void stats_enable(int report, const char *filename)
+{
+    stats_enabled = 1;
+    report_enabled = report;
+    trace_filename = filename;
+    time_base = current_time();
+}
+
+unsigned long long stats_time()
+{
+    if (! stats_enabled)
+        return 0;
+    return current_time();
+}
+
+/*
+ * Append a line to the trace file.
+ * The file is opened on first use, so that gang workers
+ * get their separate files.
+ */
+static void trace(const char *name, unsigned nbytes,
+    unsigned long long t0, unsigned long long t1)
+{
+    if (! trace_filename)
+        return;
+    if (! trace_file) {
+        static char buf [512];
+
+        if (gang_index > 0) {
+            snprintf(buf, sizeof(buf), "%s.%d", trace_filename, gang_index);
+            trace_filename = buf;
+        }
+        trace_file = fopen(trace_filename, "w");
+        if (! trace_file) {
+            perror(trace_filename);
+            exit(-1);
+        }
+        fprintf(trace_file, "# time_usec event bytes duration_usec\n");
+    }
+    fprintf(trace_file, "%llu %s %u %llu\n",
+        (t0 ? t0 : t1) - time_base, name, nbytes, t0 ? t1 - t0 : 0);
+}
+
+void stats_event(int kind, unsigned nbytes, unsigned long long t0)
+{
+    unsigned long long t1;
+
+    if (! stats_enabled)
+        return;
+    event[kind].count++;
+    event[kind].nbytes += nbytes;
+    if (t0 == 0 && ! trace_filename)
+        return;
+
+    t1 = current_time();
+    if (t0)
+        event[kind].usec += t1 - t0;
+    trace(event_name[kind], nbytes, t0, t1);
+}
+
+void stats_phase_begin(int n)
+{
+    if (! stats_enabled)
+        return;
+    phase[n].start = current_time();
+}
+
+void stats_phase_end(int n)
+{
+    if (! stats_enabled || ! phase[n].start)
+        return;
+    stats_phase_add(n, phase[n].start, current_time());
+    phase[n].start = 0;
+}
+
+void stats_phase_add(int n, unsigned long long t0, unsigned long long t1)
+{
+    char name [32];
+
+    if (! stats_enabled || ! t0)
+        return;
+    phase[n].count++;
+    phase[n].usec += t1 - t0;
+    snprintf(name, sizeof(name), "phase-%s", phase_name[n]);
+    trace(name, 0, t0, t1);
+}
+
+void stats_report()
+{
+    int i, n = 0;
+
+    if (! stats_enabled)
+        return;
+    stats_enabled = 0;
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = 0;
+    }
+    for (i=0; i<STAT_NPHASES; i++)
+        n += phase[i].count;
+    for (i=0; i<STAT_NEVENTS; i++)
+        n += event[i].count;
+    if (! report_enabled || n == 0)
+        return;
+
+    printf("Statistics:\n");
+    printf("    Phase         Count   Time, msec\n");
+    for (i=0; i<STAT_NPHASES; i++) {
+        if (phase[i].count == 0)
+            continue;
+        printf("    %-12s %6u %12.1f\n", phase_name[i],
+            phase[i].count, phase[i].usec / 1000.0);
+    }
+    printf("    Event         Count        Bytes   Time, msec   Avg, usec\n");
+    for (i=0; i<STAT_NEVENTS; i++) {
+        if (event[i].count == 0)
+            continue;
+        printf("    %-12s %6u %12llu %12.1f %11.1f\n", event_name[i],
+            event[i].count, event[i].nbytes, event[i].usec / 1000.0,
+            (double) event[i].usec / event[i].count);
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * Timing statistics and trace of adapter transactions.
+ *
+ * This file is part of PIC32PROG project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#ifndef _STATS_H
+#define _STATS_H
+
+/*
+ * Kinds of counted events.
+ */
+enum {
+    STAT_USB_OUT,           /* USB bulk or HID packet sent */
+    STAT_USB_IN,            /* USB bulk or HID packet received */
+    STAT_SERIAL_OUT,        /* Serial port write */
+    STAT_SERIAL_IN,         /* Serial port read */
+    STAT_PRACC_POLL,        /* Poll of PrAcc bit in EJTAG control */
+    STAT_COMMAND,           /* PE or bootloader command */
+    STAT_NEVENTS
+};
+
+/*
+ * Phases of the programming job.
+ */
+enum {
+    PHASE_PARSE,            /* Read the input file */
+    PHASE_OPEN,             /* Connect to the target */
+    PHASE_ERASE,            /* Chip or page erase */
+    PHASE_PE_LOAD,          /* Download of programming executive */
+    PHASE_PROGRAM,
+    PHASE_VERIFY,
+    PHASE_READ,
+    STAT_NPHASES
+};
+
+/*
+ * Nonzero when statistics or trace are requested.
+ * All the stats routines are no-ops otherwise.
+ */
+extern int stats_enabled;
+
+/*
+ * Enable collecting of statistics: with a report at exit,
+ * or a trace file, or both.
+ * In gang mode the number of target is appended to the file name.
+ */
+void stats_enable(int report, const char *trace_filename);
+
+/*
+ * Current time in microseconds, or 0 when stats are disabled.
+ */
+unsigned long long stats_time(void);
+
+/*
+ * Record an event of given kind, started at time t0.
+ * Use t0 = 0 for events without duration.
+ */
+void stats_event(int kind, unsigned nbytes, unsigned long long t0);
+
+/*
+ * Mark start and end of a phase.
+ */
+void stats_phase_begin(int phase);
+void stats_phase_end(int phase);
+
+/*
+ * Record a phase measured elsewhere, from t0 to t1.
+ * Stats are not thread safe: other threads must only
+ * take times with stats_time(), and pass them back.
+ */
+void stats_phase_add(int phase, unsigned long long t0, unsigned long long t1);
+
+/*
+ * Print a summary to stdout, when requested, and close the trace file.
+ * Collecting is stopped after that.
+ */
+void stats_report(void);
+
+#endif
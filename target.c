@@ -19,6 +19,8 @@
 #include "adapter.h"
 #include "localize.h"
 #include "pic32.h"
+#include "crc.h"
+#include "stats.h"
 
 extern print_func_t print_mx1;
 extern print_func_t print_mx3;
@@ -28,19 +30,19 @@ extern print_func_t print_mm;
 /*
  * PIC32 families.
  */
-                    /*-Boot-Devcfg--Row---Print------Code--------Nwords-Version-*/
+                    /*-Boot-Devcfg--Row---Page---Print------Code--------Nwords-Version-*/
 static const
 family_t family_mm  = { "mm",
-                        4, 0x1780,  256, print_mz,  pic32_pemm,  2000, 0x0510 };
+                        4, 0x1780,  256,  2048,  print_mz,  pic32_pemm,  2000, 0x0510 };
 static const
 family_t family_mx1 = { "mx1",
-                        3,  0x0bf0, 128,  print_mx1, pic32_pemx1, 422,  0x0301 };
+                        3,  0x0bf0, 128,  1024,  print_mx1, pic32_pemx1, 422,  0x0301 };
 static const
 family_t family_mx3 = { "mx3",
-                        12, 0x2ff0, 512,  print_mx3, pic32_pemx3, 1044, 0x0201 };
+                        12, 0x2ff0, 512,  4096,  print_mx3, pic32_pemx3, 1044, 0x0201 };
 static const
 family_t family_mz  = { "mz",
-                        80, 0xffc0, 2048, print_mz,  pic32_pemz,  1052, 0x0502 };
+                        80, 0xffc0, 2048, 16384, print_mz,  pic32_pemz,  1052, 0x0502 };
 /*
  * This one is a special one for the bootloader. We have no idea what we're
  * programming, so set the values to the maximum out of all the others.
@@ -48,15 +50,14 @@ family_t family_mz  = { "mz",
  */
 static const
 family_t family_bl  = { "bootloader",
-                        80, 0,      1024, 0,         0,           0,    0      };
+                        80, 0,      1024, 0,     0,         0,           0,    0      };
 
 /*
  * Table of PIC32 chip variants.
- * This list can be extended at run time from pic32prog.conf file.
+ * Entries from pic32prog.conf file are added at run time,
+ * into the hash index only.
  */
-#define TABSZ   1000
-
-static variant_t pic32_tab[TABSZ] = {
+static const variant_t pic32_tab[] = {
 
     /* MX1/2 family-------------Flash---Family */
     {0x4A07053, "MX110F016B",     16,   &family_mx1},
@@ -286,6 +287,61 @@ static variant_t pic32_tab[TABSZ] = {
     {0}
 };
 
+/*
+ * Hash index of chip variants: built-in ones, overridden
+ * by entries from the configuration file.
+ * Key is device id without the revision field.
+ */
+#define TABSZ   1000                        /* Max number of variants */
+#define HASHSZ  2048                        /* Power of two, > 2*TABSZ */
+
+static const variant_t *variant_hash [HASHSZ];
+static unsigned variant_count;
+
+/*
+ * Find a slot for the device id: either the matching entry, or empty.
+ */
+static unsigned variant_slot(unsigned devid)
+{
+    unsigned key = devid & 0x0fffffff;
+    unsigned h = (key * 2654435761u) >> 21;
+
+    while (variant_hash[h] &&
+           ((variant_hash[h]->devid ^ key) & 0x0fffffff) != 0)
+        h = (h + 1) & (HASHSZ - 1);
+    return h;
+}
+
+static void variant_insert(const variant_t *v)
+{
+    unsigned h = variant_slot(v->devid);
+
+    if (! variant_hash[h]) {
+        if (variant_count >= TABSZ) {
+            fprintf(stderr, "%s: Too many variants.\n", v->name);
+            return;
+        }
+        variant_count++;
+    }
+    variant_hash[h] = v;
+}
+
+/*
+ * Find the chip variant by device id.
+ * Return 0 when not found.
+ */
+static const variant_t *variant_find(unsigned devid)
+{
+    const variant_t *v;
+
+    if (variant_count == 0) {
+        /* Index the built-in table on first use. */
+        for (v=pic32_tab; v->devid; v++)
+            variant_insert(v);
+    }
+    return variant_hash[variant_slot(devid)];
+}
+
 /*
  * Table of supported serial protocols.
  */
@@ -296,6 +352,7 @@ static const struct {
     { "stk500",     adapter_open_stk500v2       },  /* Default */
     { "an1388",     adapter_open_an1388_uart    },
     { "ascii",      adapter_open_bitbang        },
+    { "sim",        adapter_open_sim            },  /* Simulator */
     { 0 },
 };
 
@@ -340,6 +397,26 @@ void mdelay(unsigned msec)
 }
 #endif
 
+/*
+ * Check whether the data are all 0xFF, i.e. need not be written
+ * to erased flash memory. Used by all adapters.
+ */
+int adapter_is_blank(const void *data, unsigned nbytes)
+{
+    const unsigned *p = data;
+    const unsigned char *q;
+
+    if (((size_t) data & 3) == 0) {
+        for (; nbytes >= 4; nbytes -= 4)
+            if (*p++ != 0xFFFFFFFF)
+                return 0;
+    }
+    for (q = (const unsigned char*) p; nbytes > 0; nbytes--)
+        if (*q++ != 0xFF)
+            return 0;
+    return 1;
+}
+
 /*
  * Open USB adapter, detected by vendor/product ID.
  * Return a pointer to adapter structure, or 0 when not found.
@@ -498,19 +575,17 @@ target_t *target_open(const char *port_name, int baud_rate)
         exit(1);
     }
 
-    unsigned i;
-    for (i=0; (t->cpuid ^ pic32_tab[i].devid) & 0x0fffffff; i++) {
-        if (pic32_tab[i].devid == 0) {
-            /* Device not detected. */
-            fprintf(stderr, _("Unknown CPUID=%08x.\n"), t->cpuid);
-            t->adapter->close(t->adapter, 0);
-            exit(1);
-        }
+    const variant_t *v = variant_find(t->cpuid);
+    if (! v) {
+        /* Device not detected. */
+        fprintf(stderr, _("Unknown CPUID=%08x.\n"), t->cpuid);
+        t->adapter->close(t->adapter, 0);
+        exit(1);
     }
-    t->family = pic32_tab[i].family;
-    t->cpu_name = pic32_tab[i].name;
+    t->family = v->family;
+    t->cpu_name = v->name;
     t->flash_addr = 0x1d000000;
-    t->flash_bytes = pic32_tab[i].flash_kbytes * 1024;
+    t->flash_bytes = v->flash_kbytes * 1024;
     if (! t->flash_bytes) {
         t->flash_addr = t->adapter->user_start;
         t->flash_bytes = t->adapter->user_nbytes;
@@ -558,33 +633,47 @@ unsigned target_block_size(target_t *t)
     return t->family->bytes_per_row;
 }
 
+unsigned target_page_size(target_t *t)
+{
+    return t->family->bytes_per_page;
+}
+
 /*
- * Add an entry to the pic32_tab[] array.
+ * Add a chip variant from config file.
+ * Entries with the same id replace the previous ones.
  */
 void target_add_variant(char *name, unsigned id,
     char *family, unsigned flash_kbytes)
 {
-    int i;
+    const variant_t *old = variant_find(id);
+    variant_t *v;
 
     //printf("'%s'\t%07x\t'%s'\t%uk\n", name, id, family, flash_kbytes);
-    for (i=0; i<TABSZ; i++) {
-        if (pic32_tab[i].devid == 0 ||
-            id == pic32_tab[i].devid) {
-            /* Add a new entry or update an existing one
-             * with new data from config file. */
-            pic32_tab[i].name = strdup(name);
-            pic32_tab[i].flash_kbytes = flash_kbytes;
-            if (strcmp(family, "MX1") == 0)
-                pic32_tab[i].family = &family_mx1;
-            else if (strcmp(family, "MX3") == 0)
-                pic32_tab[i].family = &family_mx3;
-            else if (strcmp(family, "MZ") == 0)
-                pic32_tab[i].family = &family_mz;
-            else {
-                fprintf(stderr, "%s: Unknown family=%s.\n", name, family);
-            }
-            break;
-        }
+    v = malloc(sizeof(variant_t));
+    if (! v) {
+        fprintf(stderr, _("Out of memory\n"));
+        exit(-1);
+    }
+    v->devid = id;
+    v->name = strdup(name);
+    v->flash_kbytes = flash_kbytes;
+    if (strcmp(family, "MX1") == 0)
+        v->family = &family_mx1;
+    else if (strcmp(family, "MX3") == 0)
+        v->family = &family_mx3;
+    else if (strcmp(family, "MZ") == 0)
+        v->family = &family_mz;
+    else {
+        fprintf(stderr, "%s: Unknown family=%s.\n", name, family);
+
+        /* Keep the previous data, if any. */
+        v->family = old ? old->family : 0;
+    }
+    if (v->family)
+        variant_insert(v);
+    else {
+        free((char*) v->name);
+        free(v);
     }
 }
 
@@ -593,9 +682,80 @@ void target_add_variant(char *name, unsigned id,
  */
 void target_use_executive(target_t *t)
 {
-    if (t->adapter->load_executive != 0 && t->family->pe_nwords != 0)
+    if (t->adapter->load_executive != 0 && t->family->pe_nwords != 0) {
+        stats_phase_begin(PHASE_PE_LOAD);
         t->adapter->load_executive(t->adapter,
             t->family->pe_code, t->family->pe_nwords, t->family->pe_version);
+        stats_phase_end(PHASE_PE_LOAD);
+        t->use_executive = 1;
+    }
+}
+
+/*
+ * Read configuration registers devcfg3...devcfg0.
+ * With PE, the whole configuration area is fetched in one READ
+ * burst: DEVCFG, DEVCP and DEVSIGN words, and ADEVCFG on pic32mz.
+ * Without PE, only the four devcfg words are read.
+ * The result is cached until the boot memory is erased or programmed.
+ */
+static unsigned *read_devcfg(target_t *t)
+{
+    unsigned offset = t->family->devcfg_offset;
+    int i;
+
+    if (t->config_nwords == 0) {
+        unsigned nwords = 4;
+        unsigned long long t0 = stats_time();
+
+        if (t->use_executive && t->adapter->read_data) {
+            /* Some adapters fetch 256 words at once:
+             * read the 1-kbyte block, which lies inside boot flash. */
+            offset &= ~1023;
+            nwords = 256;
+            t->adapter->read_data(t->adapter, 0x1fc00000 + offset, nwords, t->config);
+        } else if (t->adapter->read_data) {
+            t->adapter->read_data(t->adapter, 0x1fc00000 + offset, nwords, t->config);
+        } else {
+            for (i=0; i<nwords; i++)
+                t->config[i] = t->adapter->read_word(t->adapter,
+                    0x1fc00000 + offset + i*4);
+        }
+        stats_event(STAT_COMMAND, nwords * 4, t0);
+        t->config_offset = offset;
+        t->config_nwords = nwords;
+    }
+    return t->config + (t->family->devcfg_offset - t->config_offset) / 4;
+}
+
+/*
+ * Test flash and boot memory for blank, without reading it.
+ * Devcfg registers are read and compared with their erased values:
+ * bit 31 of devcfg0 reads as 0 on some parts.
+ * Return 1 when the whole memory is erased.
+ */
+int target_is_blank(target_t *t)
+{
+    unsigned boot_bytes = target_boot_bytes(t);
+    unsigned devcfg_offset = t->family->devcfg_offset;
+    unsigned *devcfg;
+
+    if (! t->adapter->blank_check(t->adapter, 0x1d000000, t->flash_bytes))
+        return 0;
+    if (boot_bytes == 0)
+        return 1;
+    if (! devcfg_offset)
+        return t->adapter->blank_check(t->adapter, 0x1fc00000, boot_bytes);
+
+    if (! t->adapter->blank_check(t->adapter, 0x1fc00000, devcfg_offset))
+        return 0;
+    if (devcfg_offset + 16 < boot_bytes &&
+        ! t->adapter->blank_check(t->adapter, 0x1fc00000 + devcfg_offset + 16,
+            boot_bytes - devcfg_offset - 16))
+        return 0;
+
+    devcfg = read_devcfg(t);
+    return devcfg[0] == 0xffffffff && devcfg[1] == 0xffffffff &&
+        devcfg[2] == 0xffffffff && (devcfg[3] | 0x80000000) == 0xffffffff;
 }
 
 /*
@@ -606,11 +766,11 @@ void target_print_devcfg(target_t *t)
     if (! t->family->devcfg_offset)
         return;
 
-    unsigned devcfg_addr = 0x1fc00000 + target_devcfg_offset(t);
-    unsigned devcfg3 = t->adapter->read_word(t->adapter, devcfg_addr);
-    unsigned devcfg2 = t->adapter->read_word(t->adapter, devcfg_addr + 4);
-    unsigned devcfg1 = t->adapter->read_word(t->adapter, devcfg_addr + 8);
-    unsigned devcfg0 = t->adapter->read_word(t->adapter, devcfg_addr + 12);
+    unsigned *devcfg = read_devcfg(t);
+    unsigned devcfg3 = devcfg[0];
+    unsigned devcfg2 = devcfg[1];
+    unsigned devcfg1 = devcfg[2];
+    unsigned devcfg0 = devcfg[3];
 
     if (devcfg3 == 0xffffffff && devcfg2 == 0xffffffff &&
         devcfg1 == 0xffffffff && devcfg0 == 0x7fffffff)
@@ -649,9 +809,11 @@ void target_read_block(target_t *t, unsigned addr,
     //fprintf(stderr, "target_read_block(addr = %x, nwords = %d)\n", addr, nwords);
     while (nwords > 0) {
         unsigned n = nwords;
-        if (n > 256)
-            n = 256;
+        if (t->adapter->read_max_words && n > t->adapter->read_max_words)
+            n = t->adapter->read_max_words;
+        unsigned long long t0 = stats_time();
         t->adapter->read_data(t->adapter, addr, n, data);
+        stats_event(STAT_COMMAND, n * 4, t0);
         addr += n<<2;
         data += n;
         nwords -= n;
@@ -669,7 +831,9 @@ void target_verify_block(target_t *t, unsigned addr,
 
     //fprintf(stderr, "%s: addr=%08x, nwords=%u, data=%08x...\n", __func__, addr, nwords, data[0]);
     if (t->adapter->verify_data != 0) {
+        unsigned long long t0 = stats_time();
         t->adapter->verify_data(t->adapter, virt_to_phys(addr), nwords, data);
+        stats_event(STAT_COMMAND, nwords * 4, t0);
         return;
     }
 
@@ -693,21 +857,71 @@ int target_erase(target_t *t)
     if (t->adapter->erase_chip) {
         printf(_("        Erase: "));
         fflush(stdout);
+        stats_phase_begin(PHASE_ERASE);
         t->adapter->erase_chip(t->adapter);
+        t->config_nwords = 0;
+        stats_phase_end(PHASE_ERASE);
         printf(_("done\n"));
     }
     return 1;
 }
 
 /*
- * Test block for non 0xFFFFFFFF value
+ * Check whether the adapter can test memory for blank.
  */
-static int target_test_empty_block(unsigned *data, unsigned nwords)
+int target_can_blank_check(target_t *t)
 {
-    while (nwords--)
-        if (*data++ != 0xFFFFFFFF)
-            return 0;
-    return 1;
+    return t->adapter->blank_check != 0 && t->family->pe_nwords != 0;
+}
+
+/*
+ * Check whether the adapter can compare and erase separate flash pages.
+ */
+int target_can_erase_pages(target_t *t)
+{
+    return t->adapter->erase_page != 0 && t->adapter->get_crc != 0 &&
+        t->family->bytes_per_page != 0;
+}
+
+/*
+ * Erase a range of flash pages.
+ */
+void target_erase_pages(target_t *t, unsigned addr, unsigned npages)
+{
+    stats_phase_begin(PHASE_ERASE);
+    t->adapter->erase_page(t->adapter, virt_to_phys(addr), npages);
+    stats_phase_end(PHASE_ERASE);
+    t->config_nwords = 0;
+}
+
+/*
+ * Check whether the adapter can compute CRC of flash memory.
+ */
+int target_can_compare_crc(target_t *t)
+{
+    return t->adapter->get_crc != 0 && t->family->pe_nwords != 0;
+}
+
+/*
+ * Get CRC of memory, computed by the PE.
+ */
+unsigned target_get_crc(target_t *t, unsigned addr, unsigned nbytes)
+{
+    unsigned long long t0 = stats_time();
+    unsigned crc = t->adapter->get_crc(t->adapter, virt_to_phys(addr), nbytes);
+
+    stats_event(STAT_COMMAND, 0, t0);
+    return crc;
+}
+
+/*
+ * Compare memory with the data by CRC.
+ * Return 1 when contents match.
+ */
+int target_compare_crc(target_t *t, unsigned addr,
+    unsigned nbytes, const unsigned char *data)
+{
+    return target_get_crc(t, addr, nbytes) == calculate_crc(0xffff, data, nbytes);
 }
 
 /*
@@ -717,16 +931,44 @@ void target_program_block(target_t *t, unsigned addr,
     unsigned nwords, unsigned *data)
 {
     addr = virt_to_phys(addr);
+    if (addr >= 0x1fc00000)
+        t->config_nwords = 0;
     //fprintf(stderr, "target_program_block(addr = %x, nwords = %d)\n", addr, nwords);
 
+    if (! t->adapter->program_block && t->adapter->program_cluster &&
+        t->family->pe_nwords != 0) {
+        /* Send every run of non-empty rows as one cluster. */
+        unsigned words_per_row = t->family->bytes_per_row / 4;
+        unsigned n;
+        while (nwords >= words_per_row) {
+            if (adapter_is_blank(data, words_per_row * 4)) {
+                addr += words_per_row<<2;
+                data += words_per_row;
+                nwords -= words_per_row;
+                continue;
+            }
+            for (n=words_per_row; n+words_per_row <= nwords; n+=words_per_row)
+                if (adapter_is_blank(data + n, words_per_row * 4))
+                    break;
+            unsigned long long t0 = stats_time();
+            t->adapter->program_cluster(t->adapter, addr, data, n, words_per_row);
+            stats_event(STAT_COMMAND, n * 4, t0);
+            addr += n<<2;
+            data += n;
+            nwords -= n;
+        }
+    }
     if (! t->adapter->program_block) {
         unsigned words_per_row = t->family->bytes_per_row / 4;
         while (nwords > 0) {
             unsigned n = nwords;
             if (n > words_per_row)
                 n = words_per_row;
-            if (! target_test_empty_block(data, words_per_row))
+            if (! adapter_is_blank(data, words_per_row * 4)) {
+                unsigned long long t0 = stats_time();
                 t->adapter->program_row(t->adapter, addr, data, words_per_row);
+                stats_event(STAT_COMMAND, words_per_row * 4, t0);
+            }
             addr += n<<2;
             data += n;
             nwords -= n;
@@ -736,7 +978,11 @@ void target_program_block(target_t *t, unsigned addr,
         unsigned n = nwords;
         if (n > 256)
             n = 256;
-        t->adapter->program_block(t->adapter, addr, data);
+        if (! adapter_is_blank(data, n * 4)) {
+            unsigned long long t0 = stats_time();
+            t->adapter->program_block(t->adapter, addr, data);
+            stats_event(STAT_COMMAND, n * 4, t0);
+        }
         addr += n<<2;
         data += n;
         nwords -= n;
@@ -745,6 +991,8 @@ void target_program_block(target_t *t, unsigned addr,
 
 /*
  * Program the configuration registers.
+ * Current values are read first: when they already match,
+ * nothing is written. Otherwise only the changed words are programmed.
  */
 void target_program_devcfg(target_t *t, unsigned devcfg0,
         unsigned devcfg1, unsigned devcfg2, unsigned devcfg3)
@@ -753,6 +1001,18 @@ void target_program_devcfg(target_t *t, unsigned devcfg0,
         return;
 
     unsigned addr = 0x1fc00000 + t->family->devcfg_offset;
+    unsigned value [4] = { devcfg3, devcfg2, devcfg1, devcfg0 };
+    unsigned *devcfg = read_devcfg(t);
+    int changed [4], i;
+
+    /* Bit 31 of devcfg0 is reserved and always reads as 0. */
+    for (i=0; i<4; i++)
+        changed[i] = (devcfg[i] ^ value[i]) & (i == 3 ? 0x7fffffff : ~0);
+    if (! changed[0] && ! changed[1] && ! changed[2] && ! changed[3]) {
+        if (debug_level > 0)
+            fprintf(stderr, "%s: devcfg0-3 unchanged\n", __func__);
+        return;
+    }
 
     fprintf(stderr, "%s: devcfg0-3 = %08x %08x %08x %08x\n", __func__, devcfg0, devcfg1, devcfg2, devcfg3);
     if (t->family->pe_version >= 0x0500) {
@@ -762,13 +1022,28 @@ void target_program_devcfg(target_t *t, unsigned devcfg0,
         if (memcmp(t->family->name, "mm", 2) == 0)
             t->adapter->program_double_word(t->adapter, 0x1FC017C8, 0xfffffff3, 0xffffffff);
 
+        /* Quad word is protected by ECC: write it as a whole. */
+        unsigned long long t0 = stats_time();
         t->adapter->program_quad_word(t->adapter, addr, devcfg3,
             devcfg2, devcfg1, devcfg0);
+        stats_event(STAT_COMMAND, 16, t0);
+        if (memcmp(t->family->name, "mm", 2) == 0)
+            t->config_nwords = 0;
+        else
+            memcpy(devcfg, value, sizeof(value));
         return;
     }
 
-    t->adapter->program_word(t->adapter, addr, devcfg3);
-    t->adapter->program_word(t->adapter, addr + 4, devcfg2);
-    t->adapter->program_word(t->adapter, addr + 8, devcfg1);
-    t->adapter->program_word(t->adapter, addr + 12, devcfg0);
+    /* Devcfg words are not a whole row, so they are written one by one. */
+    for (i=0; i<4; i++) {
+        if (! changed[i])
+            continue;
+        unsigned long long t0 = stats_time();
+        t->adapter->program_word(t->adapter, addr + i*4, value[i]);
+        stats_event(STAT_COMMAND, 4, t0);
+    }
+
+    /* Flash bits can only be cleared by programming. */
+    for (i=0; i<4; i++)
+        devcfg[i] &= value[i];
 }
@@ -20,6 +20,7 @@ typedef struct {
     unsigned        boot_kbytes;
     unsigned        devcfg_offset;
     unsigned        bytes_per_row;
+    unsigned        bytes_per_page;
     print_func_t    *print_devcfg;
     const unsigned  *pe_code;
     unsigned        pe_nwords;
@@ -41,6 +42,10 @@ typedef struct {
     unsigned        flash_addr;
     unsigned        flash_bytes;
     unsigned        boot_bytes;
+    int             use_executive;  /* PE is loaded */
+    unsigned        config [256];   /* Cached configuration area */
+    unsigned        config_offset;  /* Offset of cached area in boot memory */
+    unsigned        config_nwords;  /* Number of cached words, 0 when stale */
 } target_t;
 
 target_t *target_open(const char *port, int baud_rate);
@@ -55,6 +60,7 @@ unsigned target_flash_width(target_t *t);
 unsigned target_flash_bytes(target_t *t);
 unsigned target_boot_bytes(target_t *t);
 unsigned target_block_size(target_t *t);
+unsigned target_page_size(target_t *t);
 unsigned target_devcfg_offset(target_t *t);
 void target_print_devcfg(target_t *t);
 
@@ -64,6 +70,14 @@ void target_verify_block(target_t *t, unsigned addr,
     unsigned nwords, unsigned *data);
 
 int target_erase(target_t *t);
+int target_can_blank_check(target_t *t);
+int target_is_blank(target_t *t);
+int target_can_erase_pages(target_t *t);
+void target_erase_pages(target_t *t, unsigned addr, unsigned npages);
+int target_can_compare_crc(target_t *t);
+unsigned target_get_crc(target_t *t, unsigned addr, unsigned nbytes);
+int target_compare_crc(target_t *t, unsigned addr,
+    unsigned nbytes, const unsigned char *data);
 void target_program_block(target_t *t, unsigned addr,
     unsigned nwords, unsigned *data);
 void target_program_devcfg(target_t *t, unsigned devcfg0,